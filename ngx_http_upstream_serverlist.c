@@ -8,59 +8,333 @@
 #include "ngx_http_upstream_check_module.h"
 #endif
 
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+
 #define MAX_CONF_DUMP_PATH_LENGTH 512
 #define MAX_HTTP_REQUEST_SIZE 1024
 #define MAX_HTTP_RECEIVED_HEADERS 32
 #define DEFAULT_REFRESH_TIMEOUT_MS 2000
 #define DEFAULT_REFRESH_INTERVAL_MS 5000
 #define DEFAULT_SERVICE_CONCURRENCY 1
+#define DEFAULT_SERVICE_PIPELINE 1
+#define MAX_SERVICE_PIPELINE 64
 #define DUMP_BUFFER_SIZE 512
 #define CACHE_LINE_SIZE 128
 #define DEFAULT_SERVERLIST_POOL_SIZE 1024
+#define MAX_ETAG_LENGTH 128
+#define MAX_SERVER_NAME_LENGTH 264 // a hostname and port, or a unix path.
+#define DEFAULT_SHARED_LEASE_MS 1000
+#define DEFAULT_HELPER_SYNC_MS 1000
+#define WATCH_SYNC_MS 100 // workers check others' fetches in watch mode.
+#define DEFAULT_SHARED_ZONE_SIZE (1024 * 1024) // keeps serverlists on reload.
+#define DEFAULT_HELPER_MANAGER_MS 60000
+#define SERVICE_PHASE_HEADER 0 // status line and headers.
+#define SERVICE_PHASE_BODY 1
+#define SNAPSHOT_FILE_MAGIC "SLSNAP01"
+#define DUE_SLACK_MS 500 // fetched early along with others, at most a
+                         // quarter of the interval, like random jitter.
+#define MAX_BACKOFF_SHIFT 3 // failed serverlists wait up to 8 intervals.
+#define SETTLE_PEERS_MS 100 // conns released on retired peers reach their
+                            // successors within this.
+
+// state of one serverlist shared by all workers, fetched by one of them.
+typedef struct {
+    ngx_str_node_t                sn; // key is crc32 of the name.
+    uint64_t                      generation; // bumped on every publish.
+    ngx_pid_t                     lease_owner; // the worker fetching.
+    ngx_msec_t                    lease_expire;
+    time_t                        last_modified;
+    size_t                        etag_len;
+    u_char                        etag_data[MAX_ETAG_LENGTH];
+    off_t                         index;
+    uint64_t                      body_hash;
+    size_t                        body_len;
+    ngx_uint_t                    body_hash_valid;
+    u_char                       *snapshot; // servers, see write_snapshot.
+    size_t                        snapshot_len;
+} shared_list;
+
+typedef struct {
+    ngx_rbtree_t                  rbtree;
+    ngx_rbtree_node_t             sentinel;
+} shared_lists;
+
+// conns a retired peer handed to the peer replacing it. requests holding the
+// retired peer release their connections there, and settle_handoffs()
+// forwards that to the successor.
+typedef struct peer_handoff_s peer_handoff;
+
+struct peer_handoff_s {
+    ngx_http_upstream_rr_peer_t  *from; // retired.
+    ngx_http_upstream_rr_peer_t  *to;
+    ngx_uint_t                    conns; // of from, counted in to as well.
+    peer_handoff                 *next;
+};
+
+// peers of an upstream with zone directive live in the zone, and are written
+// there once for all workers. any worker settles and frees what was retired,
+// under the lock of the zone peers.
+typedef struct {
+    ngx_http_upstream_rr_peer_t  *retired; // unlinked by writes.
+    peer_handoff                 *handoffs; // from retired peers, in the zone.
+} zone_peers;
+
+// a reserved peer, with room for the address and names it may take.
+typedef struct {
+    ngx_http_upstream_rr_peer_t   peer;
+    ngx_sockaddr_t                sockaddr;
+    u_char                        name[NGX_SOCKADDR_STRLEN];
+    u_char                        server[MAX_SERVER_NAME_LENGTH];
+    uint32_t                      hash; // of the address.
+    ngx_uint_t                    active;
+    ngx_uint_t                    stamp;
+} peer_slot;
+
+// slots of one peer list, all linked in it so that the list never grows, and
+// its number never changes under requests. inactive ones are down and weigh
+// nothing.
+typedef struct {
+    ngx_http_upstream_rr_peers_t *peers;
+    peer_slot                    *slots;
+    ngx_uint_t                    nslots;
+    ngx_uint_t                   *free; // stack of inactive slots.
+    ngx_uint_t                    nfree;
+    ngx_uint_t                   *index; // slot + 1 by address, 0 if empty.
+    ngx_uint_t                    mask;
+    ngx_uint_t                    stamp;
+} peer_slots;
+
+// the last dump of a serverlist, written in a thread if a pool is configured.
+typedef struct {
+    u_char                       *data; // the whole file.
+    size_t                        len;
+    size_t                        size; // of data, reused by next dumps.
+    u_char                        tmpfile[MAX_CONF_DUMP_PATH_LENGTH];
+    u_char                        file[MAX_CONF_DUMP_PATH_LENGTH];
+    u_char                        dir[MAX_CONF_DUMP_PATH_LENGTH];
+    ngx_uint_t                    fsync;
+    const char                   *failed; // the call failed, NULL if none.
+    ngx_err_t                     err;
+    ngx_uint_t                    busy; // being written.
+    ngx_uint_t                    again; // servers changed while busy.
+} dump_ctx;
+
+// per-worker peers replaced by a rebuild, with the pool holding them. requests
+// in flight may still use them, they are freed once none has conns.
+typedef struct retired_peers_s retired_peers;
+
+struct retired_peers_s {
+    ngx_http_upstream_rr_peers_t *peers;
+    ngx_pool_t                   *pool; // the record is allocated in it too.
+    retired_peers                *next;
+};
 
 typedef struct {
     ngx_pool_t                   *new_pool;
     ngx_pool_t                   *pool;
-    ngx_http_upstream_srv_conf_t *upstream_conf; // TODO: should be a array to
-                                                 // store all upstreams which
-                                                 // shared one serverlist.
+    retired_peers                *retired; // newest first.
+    peer_handoff                 *handoffs; // from retired per-worker peers.
+    ngx_pool_t                   *peers_pool; // holding upstream peers, if
+                                              // they are not reserved slots
+                                              // or in a zone.
+    size_t                        arena_size; // of the next generation.
+    size_t                        bytes; // of pool and retired pools.
+    ngx_uint_t                    nservers; // of the last generation.
+    ngx_http_upstream_srv_conf_t *upstream_conf;
+    ngx_array_t                  *followers; // serverlist *, of the other
+                                             // upstreams of the same name,
+                                             // applied what this one fetched.
     ngx_str_t                     name;
     ngx_shmtx_t                   dump_file_lock; // to avoid parrallel write.
+    dump_ctx                     *dump; // NULL until first dump.
+#if (NGX_THREADS)
+    ngx_thread_task_t            *dump_task;
+#endif
 
     time_t                        last_modified;
     ngx_str_t                     etag;
+    u_char                        etag_data[MAX_ETAG_LENGTH];
+
+    off_t                         index; // X-Serverlist-Index, 0 if none.
+
+    uint64_t                      body_hash; // of the last applied body.
+    size_t                        body_len;
+    ngx_uint_t                    body_hash_valid;
+    ngx_uint_t                    resolving; // hostnames of new_pool.
+    ngx_uint_t                    queued; // in the run queue, or claimed,
+                                          // else in the due heap.
+    ngx_msec_t                    interval; // 0 means of serverlist_service.
+    ngx_msec_t                    timeout; // 0 means of serverlist_service.
+    ngx_uint_t                    priority; // higher ones claimed first.
+    ngx_msec_t                    due; // of the next fetch.
+    ngx_uint_t                    heap_index; // in the due heap, or in the
+                                              // run queue if queued.
+    ngx_uint_t                    failures; // responses failed in a row.
+    ngx_uint_t                    index_missed; // last response without one.
+
+    shared_list                  *shared; // NULL if not shared.
+    uint64_t                      generation; // of shared applied here.
+
+    zone_peers                   *zone; // NULL if peers are per worker.
+    ngx_uint_t                    max_servers; // 0 means no reserved slots.
+    peer_slots                   *slots; // primary and backup, or NULL.
 } serverlist;
 
+// addresses of a server address text, shared by the servers of every
+// serverlist of a worker that list it, as long as a generation refers to them.
+typedef struct {
+    ngx_str_node_t                sn; // key is crc32 of the text.
+    ngx_uint_t                    refs; // servers referring to addrs.
+    ngx_addr_t                   *addrs;
+    ngx_uint_t                    naddrs;
+} interned_addrs;
+
+// a node of serverlist names, to find duplicates while configuring.
+typedef struct {
+    ngx_str_node_t                sn;
+    ngx_uint_t                    index; // in serverlists.
+} serverlist_node;
+
+// a binary min-heap of serverlists, ordered by before().
+typedef struct {
+    serverlist                  **elts;
+    ngx_uint_t                    nelts;
+    ngx_int_t                   (*before)(serverlist *a, serverlist *b);
+} serverlist_heap;
+
+typedef struct {
+    uint64_t                      v[4];
+    uint64_t                      total_len;
+    u_char                        mem[32];
+    size_t                        memsize;
+} xxh64_state;
+
 typedef struct {
     ngx_peer_connection_t         peer_conn;
     ngx_buf_t                     send; // never exceed 1024.
     ngx_buf_t                     recv;
-    ngx_str_t                     body;
-    ngx_int_t                     content_length;
-    ngx_event_t                   refresh_timer;
+    ngx_chain_t                  *recv_cl; // link of recv, NULL if not held.
+    // state of the response being received, headers are parsed only once.
+    ngx_uint_t                    phase; // SERVICE_PHASE_*
+    size_t                        header_scanned; // bytes known incomplete.
+    ngx_int_t                     status;
+    ngx_str_t                     etag; // points into recv.
+    time_t                        last_modified;
+    off_t                         index; // -1 if none.
+    ngx_uint_t                    response_count; // serverlists answered.
+    ngx_str_t                     body; // received but not parsed yet.
+    ngx_int_t                     content_length; // -1 if absent.
+    size_t                        body_rest; // not received yet.
+    ngx_uint_t                    body_done;
+    ngx_uint_t                    chunked;
+    struct phr_chunked_decoder    decoder;
+
+    // section of the body being parsed, lines of one serverlist.
+    serverlist                   *section; // NULL if lines are skipped.
+    ngx_array_t                  *section_servers; // in section->new_pool.
+    xxh64_state                   section_hash;
+    ngx_str_t                     section_etag;
+    u_char                        section_etag_data[MAX_ETAG_LENGTH];
+    time_t                        section_last_modified;
+    ngx_event_t                   refresh_timer; // connects, or retries.
     ngx_event_t                   timeout_timer;
-    ngx_uint_t                    serverlists_start;
-    ngx_uint_t                    serverlists_end;
-    ngx_uint_t                    serverlists_curr;
-    ngx_time_t                    start_time;
+    // serverlists claimed from the run queue, a ring of pipeline * batch.
+    serverlist                  **claimed;
+    ngx_uint_t                   *claimed_count; // of the request whose first
+                                                 // serverlist is at the slot.
+    ngx_uint_t                    nclaimed;
+    ngx_uint_t                    serverlists_curr; // awaiting response.
+    ngx_uint_t                    serverlists_sent; // next to request.
+    ngx_uint_t                    requests; // in flight.
+    ngx_uint_t                    busy; // connecting or claimed some.
 } service_conn;
 
+typedef struct {
+    ngx_http_upstream_server_t   *old;
+    ngx_http_upstream_server_t   *new;
+} server_pair;
+
+typedef struct {
+    serverlist                   *sl;
+    ngx_array_t                  *servers; // in sl->new_pool.
+    uint64_t                      body_hash;
+    size_t                        body_len;
+    ngx_uint_t                    pending; // names not resolved yet.
+    ngx_uint_t                    failed;
+} resolve_job;
+
+typedef struct {
+    resolve_job                  *job;
+    ngx_http_upstream_server_t   *server;
+    in_port_t                     port;
+} resolve_name;
+
+typedef struct {
+    ngx_array_t                   added;     // ngx_http_upstream_server_t *
+    ngx_array_t                   removed;   // ngx_http_upstream_server_t *
+    ngx_array_t                   modified;  // server_pair
+    ngx_array_t                   unchanged; // server_pair
+} server_changes;
+
 typedef struct {
     ngx_http_conf_ctx_t          *conf_ctx;
     ngx_pool_t                   *conf_pool;
-    ngx_pool_t                   *prev_conf_pool;
     ngx_array_t                   service_conns;
-    ngx_array_t                   serverlists;
+    ngx_array_t                   serverlists; // fetched, one per name.
+    ngx_array_t                   followers; // serverlist, not fetched.
 
     ngx_uint_t                    service_concurrency;
-    ngx_int_t                     conf_pool_count;
+    ngx_uint_t                    service_pipeline;
+    ngx_uint_t                    service_batch; // 0 means no batch.
+    size_t                        request_size;  // upper bound of a request.
     ngx_url_t                     service_url;
     ngx_str_t                     conf_dump_dir;
+    ngx_uint_t                    dump_fsync;
+#if (NGX_THREADS)
+    ngx_thread_pool_t            *dump_thread_pool; // NULL if dump in place.
+#endif
+    ngx_str_t                     snapshot_file; // of all serverlists.
+    ngx_shmtx_t                   snapshot_lock;
+    dump_ctx                     *snapshot; // NULL until first written.
+    ngx_event_t                   snapshot_timer;
+#if (NGX_THREADS)
+    ngx_thread_task_t            *snapshot_task;
+#endif
+
+    ngx_shm_zone_t               *shm_zone; // NULL if no serverlist.
+    ngx_slab_pool_t              *shpool;
+    shared_lists                 *sh;
+    ngx_uint_t                    share; // workers share fetches, shm_size.
+
+    ngx_uint_t                    service_helper; // fetch in helper process.
+    ngx_uint_t                    helper_started; // by helper_manager().
+    // due serverlists of this worker by priority, any idle service_conn
+    // claims from it.
+    serverlist_heap               run_queue;
+    ngx_uint_t                    in_flight; // claimed, not answered yet.
+    ngx_uint_t                    body_unchanged; // skipped by body hash,
+                                                  // since unchanged_logged.
+    ngx_msec_t                    unchanged_logged;
+    serverlist_heap               due; // not queued, by due time.
+    ngx_event_t                   refresh_timer; // at the first due time.
+    ngx_chain_t                  *free_recv_bufs; // of ngx_pagesize, not held
+                                                  // by connections.
+    ngx_rbtree_t                  interned; // interned_addrs
+    ngx_rbtree_node_t             interned_sentinel;
+    ngx_pool_t                   *intern_pool; // scratch, reset after use.
+    ngx_event_t                   sync_timer; // of workers in helper mode.
+    ngx_event_t                   settle_timer; // while retired peers are
+                                                // held by requests.
 } main_conf;
 
 static void *
 create_main_conf(ngx_conf_t *cf);
 
+static char *
+init_main_conf(ngx_conf_t *cf, void *conf);
+
 static char *
 merge_server_conf(ngx_conf_t *cf, void *parent, void *child);
 
@@ -70,12 +344,43 @@ serverlist_service_directive(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy);
 static char *
 serverlist_directive(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy);
 
+static ngx_int_t
+init_shared_zone(ngx_shm_zone_t *shm_zone, void *data);
+
 static ngx_int_t
 init_module(ngx_cycle_t *cycle);
 
+static ngx_int_t
+split_followers(ngx_conf_t *cf, main_conf *mcf);
+
+static ngx_int_t
+reserve_peer_slots(serverlist *sl, ngx_cycle_t *cycle);
+
+static void
+apply_section(serverlist *sl, ngx_array_t *servers, uint64_t body_hash,
+    size_t body_len, ngx_uint_t publish, ngx_log_t *log);
+
 static ngx_int_t
 init_process(ngx_cycle_t *cycle);
 
+static ngx_int_t
+start_process(ngx_cycle_t *cycle);
+
+static void
+settle_timer_handler(ngx_event_t *ev);
+
+static ngx_int_t
+due_before(serverlist *a, serverlist *b);
+
+static ngx_int_t
+priority_before(serverlist *a, serverlist *b);
+
+static void
+schedule_serverlist(main_conf *mcf, serverlist *sl, ngx_msec_t delay);
+
+static void
+refresh_due(ngx_event_t *ev);
+
 static void
 refresh_timeout_handler(ngx_event_t *ev);
 
@@ -88,6 +393,24 @@ send_to_service(ngx_event_t *ev);
 static void
 recv_from_service(ngx_event_t *ev);
 
+static void
+sync_serverlist(serverlist *sl, ngx_log_t *log);
+
+static void
+sync_timer_handler(ngx_event_t *ev);
+
+static void
+dump_serverlist(serverlist *sl);
+
+static void
+load_dump(serverlist *sl, ngx_log_t *log);
+
+static void
+load_snapshot_file(main_conf *mcf, ngx_log_t *log);
+
+static void
+snapshot_timer_handler(ngx_event_t *ev);
+
 static ngx_command_t module_commands[] = {
     {
         ngx_string("serverlist"),
@@ -114,7 +437,7 @@ static ngx_http_module_t module_ctx = {
     NULL,                                  /* postconfiguration */
 
     create_main_conf,                      /* create main configuration */
-    NULL,                                  /* init main configuration */
+    init_main_conf,                        /* init main configuration */
 
     NULL,                                  /* create server configuration */
     merge_server_conf,                     /* merge server configuration */
@@ -138,14 +461,45 @@ ngx_module_t ngx_http_upstream_serverlist_module = {
     NGX_MODULE_V1_PADDING
 };
 
+static ngx_str_t shared_zone_name = ngx_string("upstream_serverlist");
 static ngx_int_t refresh_interval_ms = DEFAULT_REFRESH_INTERVAL_MS;
 static ngx_int_t refresh_timeout_ms = DEFAULT_REFRESH_TIMEOUT_MS;
+static ngx_int_t watch_timeout_ms = 0; // 0 means watch mode is off.
 
 static ngx_int_t
 random_interval_ms() {
     return refresh_interval_ms + ngx_random() % 500;
 }
 
+static ngx_msec_t
+interval_of(serverlist *sl) {
+    return sl->interval > 0 ? sl->interval : (ngx_msec_t)refresh_interval_ms;
+}
+
+// the interval of sl with a random jitter, of up to a quarter of it.
+static ngx_msec_t
+random_interval_of(serverlist *sl) {
+    ngx_msec_t interval = interval_of(sl);
+
+    return interval + ngx_random() % (ngx_min(interval / 4, DUE_SLACK_MS) + 1);
+}
+
+// how early sl is fetched along with others due. not in watch mode, where
+// serverlists are due at once after their responses anyway.
+static ngx_msec_t
+due_slack_of(serverlist *sl) {
+    return watch_timeout_ms > 0 ? 0 : ngx_min(interval_of(sl) / 4,
+        DUE_SLACK_MS);
+}
+
+// the service may hold a request up to watch_timeout_ms in watch mode, that is
+// not counted as a failure.
+static ngx_msec_t
+timeout_of(serverlist *sl) {
+    return (sl->timeout > 0 ? sl->timeout : (ngx_msec_t)refresh_timeout_ms)
+        + watch_timeout_ms;
+}
+
 static ngx_int_t
 whole_world_exiting() {
     if (ngx_terminate || ngx_exiting || ngx_quit) {
@@ -180,13 +534,218 @@ create_main_conf(ngx_conf_t *cf) {
     mcf->service_url.default_port = 80;
     mcf->service_url.uri_part = 1;
     mcf->service_concurrency = DEFAULT_SERVICE_CONCURRENCY;
+    mcf->service_pipeline = DEFAULT_SERVICE_PIPELINE;
     mcf->conf_ctx = cf->ctx;
     mcf->conf_pool = cf->pool;
-    mcf->conf_pool_count = 0; 
-    
+    ngx_rbtree_init(&mcf->interned, &mcf->interned_sentinel,
+        ngx_str_rbtree_insert_value);
+
     return mcf;
 }
 
+// keeps in serverlists the first upstream of each serverlist name, and moves
+// the others to followers, attached to it. only the first one is fetched.
+static ngx_int_t
+split_followers(ngx_conf_t *cf, main_conf *mcf) {
+    ngx_array_t leaders;
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    serverlist_node *node = NULL;
+    serverlist *sl = NULL, *leader = NULL, *copy = NULL, **follower = NULL;
+    uint32_t hash = 0;
+    ngx_uint_t i = 0;
+
+    if (ngx_array_init(&leaders, cf->pool, mcf->serverlists.nelts,
+            sizeof(serverlist)) != NGX_OK ||
+        ngx_array_init(&mcf->followers, cf->pool, 1,
+            sizeof(serverlist)) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_rbtree_init(&rbtree, &sentinel, ngx_str_rbtree_insert_value);
+
+    // copies first, so that serverlists do not move once linked.
+    for (i = 0; i < mcf->serverlists.nelts; i++) {
+        sl = (serverlist *)mcf->serverlists.elts + i;
+        hash = ngx_crc32_short(sl->name.data, sl->name.len);
+        node = (serverlist_node *)ngx_str_rbtree_lookup(&rbtree, &sl->name,
+            hash);
+        if (node != NULL) {
+            copy = ngx_array_push(&mcf->followers);
+            if (copy == NULL) {
+                return NGX_ERROR;
+            }
+            *copy = *sl;
+
+            // fetched as the most demanding of them asks.
+            leader = (serverlist *)leaders.elts + node->index;
+            leader->interval = ngx_min(interval_of(leader), interval_of(sl));
+            leader->timeout = ngx_max(
+                leader->timeout > 0 ? leader->timeout
+                    : (ngx_msec_t)refresh_timeout_ms,
+                sl->timeout > 0 ? sl->timeout
+                    : (ngx_msec_t)refresh_timeout_ms);
+            leader->priority = ngx_max(leader->priority, sl->priority);
+            continue;
+        }
+
+        node = ngx_palloc(cf->temp_pool, sizeof *node);
+        leader = ngx_array_push(&leaders);
+        if (node == NULL || leader == NULL) {
+            return NGX_ERROR;
+        }
+
+        *leader = *sl;
+        node->sn.str = sl->name;
+        node->sn.node.key = hash;
+        node->index = leaders.nelts - 1;
+        ngx_rbtree_insert(&rbtree, &node->sn.node);
+    }
+
+    for (i = 0; i < mcf->followers.nelts; i++) {
+        sl = (serverlist *)mcf->followers.elts + i;
+        node = (serverlist_node *)ngx_str_rbtree_lookup(&rbtree, &sl->name,
+            ngx_crc32_short(sl->name.data, sl->name.len));
+        leader = (serverlist *)leaders.elts + node->index;
+
+        if (leader->followers == NULL) {
+            leader->followers = ngx_array_create(cf->pool, 1,
+                sizeof(serverlist *));
+            if (leader->followers == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        follower = ngx_array_push(leader->followers);
+        if (follower == NULL) {
+            return NGX_ERROR;
+        }
+        *follower = sl;
+    }
+
+    mcf->serverlists = leaders;
+    return NGX_OK;
+}
+
+// nginx does not inherit a shared zone whose size changed, so what it kept is
+// lost, and every serverlist is fetched again unconditionally.
+static void
+check_shared_zone_size(ngx_conf_t *cf, size_t size) {
+    ngx_cycle_t *old_cycle = cf->cycle->old_cycle;
+    ngx_list_part_t *part = NULL;
+    ngx_shm_zone_t *zone = NULL;
+    ngx_uint_t i = 0;
+
+    if (old_cycle == NULL || ngx_is_init_cycle(old_cycle)) {
+        return;
+    }
+
+    part = &old_cycle->shared_memory.part;
+    zone = part->elts;
+
+    for (i = 0; /* void */; i++) {
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                return;
+            }
+            part = part->next;
+            zone = part->elts;
+            i = 0;
+        }
+
+        if (zone[i].tag != &ngx_http_upstream_serverlist_module ||
+                zone[i].shm.name.len != shared_zone_name.len ||
+                ngx_strncmp(zone[i].shm.name.data, shared_zone_name.data,
+                    shared_zone_name.len) != 0) {
+            continue;
+        }
+
+        if (zone[i].shm.size != size) {
+            ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
+                "upstream-serverlist: shared zone resized from %uz to %uz, "
+                "what it kept is dropped, every serverlist is fetched again",
+                zone[i].shm.size, size);
+        }
+        return;
+    }
+}
+
+// without shm_size, serverlists are still kept in a shared zone, only to
+// survive reloads: new workers apply them and their validators at once, and
+// fetch conditionally, instead of all fetching everything at the same time.
+static char *
+init_main_conf(ngx_conf_t *cf, void *conf) {
+    main_conf *mcf = conf;
+    size_t size = 0;
+
+    if (mcf->serverlists.nelts <= 0) {
+        return NGX_CONF_OK;
+    }
+
+    if (split_followers(cf, mcf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (mcf->shm_zone != NULL) {
+        return NGX_CONF_OK;
+    }
+
+    // a zone of another size is not inherited, so it doubles in steps with
+    // room for as many serverlists again, and adding a few keeps its size.
+    size = DEFAULT_SHARED_ZONE_SIZE;
+    while (size < 2 * mcf->serverlists.nelts * ngx_pagesize) {
+        size <<= 1;
+    }
+
+    check_shared_zone_size(cf, size);
+    mcf->shm_zone = ngx_shared_memory_add(cf, &shared_zone_name, size,
+        &ngx_http_upstream_serverlist_module);
+    if (mcf->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    mcf->shm_zone->init = init_shared_zone;
+    mcf->shm_zone->data = mcf;
+    return NGX_CONF_OK;
+}
+
+static ngx_msec_t
+helper_manager(void *data) {
+    main_conf *mcf = data;
+
+    // only the cache manager calls path managers, at once after it starts.
+    // then the helper process is driven by the timers of service_conns, this
+    // only keeps it alive.
+    if (!mcf->helper_started) {
+        mcf->helper_started = 1;
+        if (start_process((ngx_cycle_t *) ngx_cycle) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                "upstream-serverlist: start helper process failed");
+        }
+    }
+
+    return DEFAULT_HELPER_MANAGER_MS;
+}
+
+// nginx spawns a helper process, the cache manager, if any path has a
+// manager. service_conns live in it instead of in workers. the path is
+// conf_dump_dir, which must already exist, so nginx creates no directory.
+static ngx_int_t
+add_helper_path(ngx_conf_t *cf, main_conf *mcf) {
+    ngx_path_t *path = ngx_pcalloc(cf->pool, sizeof *path);
+    if (path == NULL) {
+        return NGX_ERROR;
+    }
+
+    path->name = mcf->conf_dump_dir;
+    path->manager = helper_manager;
+    path->data = mcf;
+    path->conf_file = cf->conf_file->file.name.data;
+    path->line = cf->conf_file->line;
+
+    return ngx_add_path(cf, &path);
+}
+
 static char *
 serverlist_service_directive(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy) {
     main_conf *mcf = ngx_http_conf_get_module_main_conf(cf,
@@ -225,6 +784,25 @@ serverlist_service_directive(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy) {
                     "failed");
                 return NGX_CONF_ERROR;
             }
+        } else if (s->len > 14 && ngx_strncmp(s->data, "snapshot_file=",
+                14) == 0) {
+            mcf->snapshot_file.data = s->data + 14;
+            mcf->snapshot_file.len = s->len - 14;
+            if (ngx_conf_full_name(cf->cycle, &mcf->snapshot_file,
+                    1) != NGX_OK) {
+                ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                    "upstream-serverlist: get full path of 'snapshot_file' "
+                    "failed");
+                return NGX_CONF_ERROR;
+            }
+
+            // leaves room for the suffix of the temporary file.
+            if (mcf->snapshot_file.len + 8 >= MAX_CONF_DUMP_PATH_LENGTH) {
+                ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                    "upstream-serverlist: argument 'snapshot_file' value "
+                    "too long");
+                return NGX_CONF_ERROR;
+            }
         } else if (s->len > 9 && ngx_strncmp(s->data, "interval=", 9) == 0) {
             ngx_str_t itv_str = {.data = s->data + 9, .len = s->len - 9};
             ngx_int_t itv = 0;
@@ -247,6 +825,17 @@ serverlist_service_directive(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy) {
             }
 
             refresh_timeout_ms = itv;
+        } else if (s->len > 6 && ngx_strncmp(s->data, "watch=", 6) == 0) {
+            ngx_str_t itv_str = {.data = s->data + 6, .len = s->len - 6};
+            ngx_int_t itv = 0;
+            itv = ngx_parse_time(&itv_str, 0);
+            if (itv == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                    "upstream-serverlist: argument 'watch' value invalid");
+                return NGX_CONF_ERROR;
+            }
+
+            watch_timeout_ms = itv;
         } else if (s->len > 12 && ngx_strncmp(s->data, "concurrency=",
                 12) == 0) {
             ret = ngx_atoi(s->data + 12, s->len - 12);
@@ -258,6 +847,84 @@ serverlist_service_directive(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy) {
             }
 
             mcf->service_concurrency = ret;
+        } else if (s->len > 9 && ngx_strncmp(s->data, "pipeline=", 9) == 0) {
+            ret = ngx_atoi(s->data + 9, s->len - 9);
+            if (ret == NGX_ERROR || ret == 0 || ret > MAX_SERVICE_PIPELINE) {
+                ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                    "upstream-serverlist: argument 'pipeline' value "
+                    "invalid, must between 1 and %d", MAX_SERVICE_PIPELINE);
+                return NGX_CONF_ERROR;
+            }
+
+            mcf->service_pipeline = ret;
+        } else if (s->len > 6 && ngx_strncmp(s->data, "batch=", 6) == 0) {
+            ret = ngx_atoi(s->data + 6, s->len - 6);
+            if (ret == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                    "upstream-serverlist: argument 'batch' value invalid");
+                return NGX_CONF_ERROR;
+            }
+
+            mcf->service_batch = ret;
+        } else if (s->len > 9 && ngx_strncmp(s->data, "shm_size=", 9) == 0) {
+            ngx_str_t size_str = {.data = s->data + 9, .len = s->len - 9};
+            ssize_t size = ngx_parse_size(&size_str);
+            if (size == NGX_ERROR || size < (ssize_t)(8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                    "upstream-serverlist: argument 'shm_size' value invalid, "
+                    "must be at least %uz", 8 * ngx_pagesize);
+                return NGX_CONF_ERROR;
+            }
+
+            check_shared_zone_size(cf, size);
+            mcf->shm_zone = ngx_shared_memory_add(cf, &shared_zone_name,
+                size, &ngx_http_upstream_serverlist_module);
+            if (mcf->shm_zone == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            mcf->shm_zone->init = init_shared_zone;
+            mcf->shm_zone->data = mcf;
+            mcf->share = 1;
+        } else if (s->len > 11 && ngx_strncmp(s->data, "dump_fsync=", 11)
+                == 0) {
+            if (s->len == 13 && ngx_strncmp(s->data + 11, "on", 2) == 0) {
+                mcf->dump_fsync = 1;
+            } else if (s->len == 14 && ngx_strncmp(s->data + 11, "off",
+                    3) == 0) {
+                mcf->dump_fsync = 0;
+            } else {
+                ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                    "upstream-serverlist: argument 'dump_fsync' value "
+                    "invalid, must be on or off");
+                return NGX_CONF_ERROR;
+            }
+        } else if (s->len > 17 && ngx_strncmp(s->data, "dump_thread_pool=",
+                17) == 0) {
+#if (NGX_THREADS)
+            ngx_str_t pool_name = {.data = s->data + 17, .len = s->len - 17};
+            mcf->dump_thread_pool = ngx_thread_pool_add(cf, &pool_name);
+            if (mcf->dump_thread_pool == NULL) {
+                return NGX_CONF_ERROR;
+            }
+#else
+            ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                "upstream-serverlist: argument 'dump_thread_pool' needs nginx "
+                "built with --with-threads");
+            return NGX_CONF_ERROR;
+#endif
+        } else if (s->len > 7 && ngx_strncmp(s->data, "helper=", 7) == 0) {
+            if (s->len == 9 && ngx_strncmp(s->data + 7, "on", 2) == 0) {
+                mcf->service_helper = 1;
+            } else if (s->len == 10 && ngx_strncmp(s->data + 7, "off",
+                    3) == 0) {
+                mcf->service_helper = 0;
+            } else {
+                ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                    "upstream-serverlist: argument 'helper' value invalid, "
+                    "must be on or off");
+                return NGX_CONF_ERROR;
+            }
         } else {
             ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
                 "upstream-serverlist: argument '%V' format error", s);
@@ -265,6 +932,32 @@ serverlist_service_directive(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy) {
         }
     }
 
+    if (watch_timeout_ms > 0 && mcf->service_pipeline > 1) {
+        // a held request would hold up every response behind it.
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+            "upstream-serverlist: argument 'pipeline' is ignored with "
+            "'watch'");
+        mcf->service_pipeline = 1;
+    }
+
+    if (mcf->service_helper) {
+        if (mcf->shm_zone == NULL) {
+            ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                "upstream-serverlist: argument 'helper' need 'shm_size'");
+            return NGX_CONF_ERROR;
+        }
+
+        if (mcf->conf_dump_dir.len <= 0) {
+            ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                "upstream-serverlist: argument 'helper' need 'conf_dump_dir'");
+            return NGX_CONF_ERROR;
+        }
+
+        if (add_helper_path(cf, mcf) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
     return NGX_CONF_OK;
 }
 
@@ -275,10 +968,13 @@ serverlist_directive(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy) {
     main_conf *mcf = ngx_http_conf_get_module_main_conf(cf,
         ngx_http_upstream_serverlist_module);
     serverlist *sl = NULL;
+    ngx_str_t *args = cf->args->elts;
+    ngx_int_t n = 0;
+    ngx_uint_t i = 0;
 
-    if (cf->args->nelts > 2) {
+    if (cf->args->nelts > 6) {
         ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
-            "upstream-serverlist: serverlist only need 0 or 1 args");
+            "upstream-serverlist: serverlist only need 0 to 5 args");
         return NGX_CONF_ERROR;
     }
 
@@ -290,8 +986,57 @@ serverlist_directive(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy) {
     ngx_memzero(sl, sizeof *sl);
     sl->upstream_conf = uscf;
     sl->last_modified = -1;
-    sl->name = cf->args->nelts <= 1 ? uscf->host
-        : ((ngx_str_t *)cf->args->elts)[1];
+    sl->name = uscf->host;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(args[i].data, "max_servers=", 12) == 0) {
+            n = ngx_atoi(args[i].data + 12, args[i].len - 12);
+            if (n == NGX_ERROR || n <= 0) {
+                ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                    "upstream-serverlist: argument 'max_servers' value "
+                    "invalid");
+                return NGX_CONF_ERROR;
+            }
+            sl->max_servers = n;
+        } else if (args[i].len > 9 &&
+                ngx_strncmp(args[i].data, "interval=", 9) == 0) {
+            ngx_str_t itv_str = {.data = args[i].data + 9,
+                .len = args[i].len - 9};
+            n = ngx_parse_time(&itv_str, 0);
+            if (n == NGX_ERROR || n == 0) {
+                ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                    "upstream-serverlist: argument 'interval' value invalid");
+                return NGX_CONF_ERROR;
+            }
+            sl->interval = n;
+        } else if (args[i].len > 8 &&
+                ngx_strncmp(args[i].data, "timeout=", 8) == 0) {
+            ngx_str_t itv_str = {.data = args[i].data + 8,
+                .len = args[i].len - 8};
+            n = ngx_parse_time(&itv_str, 0);
+            if (n == NGX_ERROR || n == 0) {
+                ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                    "upstream-serverlist: argument 'timeout' value invalid");
+                return NGX_CONF_ERROR;
+            }
+            sl->timeout = n;
+        } else if (args[i].len > 9 &&
+                ngx_strncmp(args[i].data, "priority=", 9) == 0) {
+            n = ngx_atoi(args[i].data + 9, args[i].len - 9);
+            if (n == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                    "upstream-serverlist: argument 'priority' value invalid");
+                return NGX_CONF_ERROR;
+            }
+            sl->priority = n;
+        } else if (i == 1) {
+            sl->name = args[i];
+        } else {
+            ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                "upstream-serverlist: unknown argument %V", &args[i]);
+            return NGX_CONF_ERROR;
+        }
+    }
 
     return NGX_CONF_OK;
 }
@@ -343,29 +1088,120 @@ merge_server_conf(ngx_conf_t *cf, void *parent, void *child) {
 }
 
 static ngx_int_t
-init_module(ngx_cycle_t *cycle) {
-    main_conf *mcf = ngx_http_cycle_get_module_main_conf(cycle,
-        ngx_http_upstream_serverlist_module);
-    serverlist *sl = NULL;
-    ngx_shm_t shm = {0};
-    ngx_uint_t i = 0;
-    ngx_int_t ret = -1;
-
-#if !(NGX_HAVE_ATOMIC_OPS)
-    ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
-        "upstream-serverlist: this module need ATOMIC_OPS support!!!");
-    return NGX_ERROR;
-#endif
+init_shared_zone(ngx_shm_zone_t *shm_zone, void *data) {
+    main_conf *omcf = data;
+    main_conf *mcf = shm_zone->data;
+
+    if (omcf != NULL) {
+        // reload, keeps what the old cycle shared.
+        mcf->shpool = omcf->shpool;
+        mcf->sh = omcf->sh;
+        return NGX_OK;
+    }
 
-    if (mcf->serverlists.nelts <= 0) {
+    mcf->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+    if (shm_zone->shm.exists) {
+        mcf->sh = mcf->shpool->data;
         return NGX_OK;
     }
 
-    // align to cache line to avoid false sharing.
-    shm.size = CACHE_LINE_SIZE * mcf->serverlists.nelts;
-    shm.log = cycle->log;
-    ngx_str_set(&shm.name, "upstream-serverlist-shared-zone");
-    if (ngx_shm_alloc(&shm) != NGX_OK) {
+    mcf->sh = ngx_slab_alloc(mcf->shpool, sizeof *mcf->sh);
+    if (mcf->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    mcf->shpool->data = mcf->sh;
+    ngx_rbtree_init(&mcf->sh->rbtree, &mcf->sh->sentinel,
+        ngx_str_rbtree_insert_value);
+
+    mcf->shpool->log_ctx = (u_char *)" in upstream-serverlist shared zone";
+    return NGX_OK;
+}
+
+// finds or creates the shared state of serverlist sl.
+static shared_list *
+get_shared_list(main_conf *mcf, serverlist *sl) {
+    shared_list *shl = NULL;
+    uint32_t hash = ngx_crc32_short(sl->name.data, sl->name.len);
+
+    ngx_shmtx_lock(&mcf->shpool->mutex);
+
+    shl = (shared_list *)ngx_str_rbtree_lookup(&mcf->sh->rbtree, &sl->name,
+        hash);
+    if (shl != NULL) {
+        goto done;
+    }
+
+    shl = ngx_slab_calloc_locked(mcf->shpool, sizeof *shl + sl->name.len);
+    if (shl == NULL) {
+        goto done;
+    }
+
+    shl->sn.str.data = (u_char *)(shl + 1);
+    shl->sn.str.len = sl->name.len;
+    ngx_memcpy(shl->sn.str.data, sl->name.data, sl->name.len);
+    shl->sn.node.key = hash;
+    shl->last_modified = -1;
+    ngx_rbtree_insert(&mcf->sh->rbtree, &shl->sn.node);
+
+done:
+    ngx_shmtx_unlock(&mcf->shpool->mutex);
+    return shl;
+}
+
+// prepares where peers of the upstream of sl are changed, in its zone or in
+// reserved slots, if it has them.
+static ngx_int_t
+init_upstream_peers(serverlist *sl, ngx_cycle_t *cycle) {
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_slab_pool_t *shpool = NULL;
+
+    // upstream zones are filled before modules are initialized.
+    shpool = ((ngx_http_upstream_rr_peers_t *)
+        sl->upstream_conf->peer.data)->shpool;
+    if (shpool != NULL) {
+        sl->zone = ngx_slab_calloc(shpool, sizeof *sl->zone);
+        if (sl->zone == NULL) {
+            ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                "upstream-serverlist: zone of upstream %V is full, "
+                "serverlist %V keeps peers per worker",
+                &sl->upstream_conf->host, &sl->name);
+        }
+    }
+#endif
+
+    if (sl->max_servers > 0) {
+        return reserve_peer_slots(sl, cycle);
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+init_module(ngx_cycle_t *cycle) {
+    main_conf *mcf = ngx_http_cycle_get_module_main_conf(cycle,
+        ngx_http_upstream_serverlist_module);
+    serverlist *sl = NULL;
+    ngx_shm_t shm = {0};
+    ngx_uint_t i = 0;
+    ngx_int_t ret = -1;
+
+#if !(NGX_HAVE_ATOMIC_OPS)
+    ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+        "upstream-serverlist: this module need ATOMIC_OPS support!!!");
+    return NGX_ERROR;
+#endif
+
+    if (mcf->serverlists.nelts <= 0) {
+        return NGX_OK;
+    }
+
+    // align to cache line to avoid false sharing. the last line is of the
+    // snapshot file lock.
+    shm.size = CACHE_LINE_SIZE * (mcf->serverlists.nelts + 1);
+    shm.log = cycle->log;
+    ngx_str_set(&shm.name, "upstream-serverlist-shared-zone");
+    if (ngx_shm_alloc(&shm) != NGX_OK) {
         return NGX_ERROR;
     }
 
@@ -376,6 +1212,22 @@ init_module(ngx_cycle_t *cycle) {
         if ( ret != NGX_OK) {
             return NGX_ERROR;
         }
+
+        if (init_upstream_peers(sl, cycle) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    for (i = 0; i < mcf->followers.nelts; i++) {
+        sl = (serverlist *)mcf->followers.elts + i;
+        if (init_upstream_peers(sl, cycle) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ngx_shmtx_create(&mcf->snapshot_lock, (ngx_shmtx_sh_t *)(shm.addr
+            + CACHE_LINE_SIZE * mcf->serverlists.nelts), NULL) != NGX_OK) {
+        return NGX_ERROR;
     }
 
     return NGX_OK;
@@ -383,44 +1235,109 @@ init_module(ngx_cycle_t *cycle) {
 
 static ngx_int_t
 init_process(ngx_cycle_t *cycle) {
+    // the cache loader is a helper process too, and exits once loaded. the
+    // cache manager is started by helper_manager().
+    if (ngx_process != NGX_PROCESS_WORKER &&
+            ngx_process != NGX_PROCESS_SINGLE) {
+        return NGX_OK;
+    }
+
+    return start_process(cycle);
+}
+
+static ngx_int_t
+start_process(ngx_cycle_t *cycle) {
     main_conf *mcf = ngx_http_cycle_get_module_main_conf(cycle,
         ngx_http_upstream_serverlist_module);
+    serverlist *sl = NULL;
     ngx_uint_t i = 0;
-    ngx_uint_t blocksize = 0;
+    size_t namelen = 0;
+
+    mcf->settle_timer.handler = settle_timer_handler;
+    mcf->settle_timer.log = cycle->log;
+    mcf->settle_timer.data = mcf;
+    mcf->unchanged_logged = ngx_current_msec;
+
+    mcf->intern_pool = ngx_create_pool(ngx_pagesize, cycle->log);
+    if (mcf->intern_pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; mcf->sh != NULL && i < mcf->serverlists.nelts; i++) {
+        sl = (serverlist *)mcf->serverlists.elts + i;
+        sl->shared = get_shared_list(mcf, sl);
+        if (sl->shared == NULL) {
+            ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                "upstream-serverlist: shared zone is full, serverlist %V is "
+                "%s", &sl->name, mcf->share ? "fetched by every worker"
+                : "not kept on reload");
+            continue;
+        }
+
+        // what the workers of the last cycle applied, with its validators.
+        sync_serverlist(sl, cycle->log);
+    }
+
+    mcf->snapshot_timer.handler = snapshot_timer_handler;
+    mcf->snapshot_timer.log = cycle->log;
+    mcf->snapshot_timer.data = mcf;
 
-    if (ngx_process != NGX_PROCESS_WORKER
-            && ngx_process != NGX_PROCESS_SINGLE) {
+    // serverlists kept in the shared zone are not loaded again from files,
+    // nor those in the snapshot file from dumps.
+    load_snapshot_file(mcf, cycle->log);
+    for (i = 0; i < mcf->serverlists.nelts; i++) {
+        load_dump((serverlist *)mcf->serverlists.elts + i, cycle->log);
+    }
+
+    if (mcf->service_helper && ngx_process == NGX_PROCESS_WORKER) {
+        // the helper process fetches, workers only apply what it publishes.
+        mcf->sync_timer.handler = sync_timer_handler;
+        mcf->sync_timer.log = cycle->log;
+        mcf->sync_timer.data = mcf;
+        ngx_add_timer(&mcf->sync_timer, 1);
         return NGX_OK;
     }
 
-    if (mcf->serverlists.nelts >= mcf->service_concurrency) {
-        blocksize = (mcf->serverlists.nelts + (mcf->service_concurrency - 1))
-            / mcf->service_concurrency;
-    } else {
-        blocksize = 1;
+    mcf->request_size = MAX_HTTP_REQUEST_SIZE;
+    if (mcf->service_batch) {
+        for (i = 0; i < mcf->serverlists.nelts; i++) {
+            sl = (serverlist *)mcf->serverlists.elts + i;
+            namelen = ngx_max(namelen, sl->name.len);
+        }
+
+        // headers, then one line of name, etag, last modified and index per
+        // serverlist.
+        mcf->request_size += mcf->service_batch
+            * (namelen + MAX_ETAG_LENGTH + NGX_TIME_T_LEN + NGX_OFF_T_LEN + 4);
+    }
+
+    // every serverlist is in one of them, at most once.
+    mcf->run_queue.elts = ngx_pcalloc(mcf->conf_pool,
+        ngx_max(mcf->serverlists.nelts, 1) * sizeof(serverlist *));
+    mcf->run_queue.before = priority_before;
+    mcf->due.elts = ngx_pcalloc(mcf->conf_pool,
+        ngx_max(mcf->serverlists.nelts, 1) * sizeof(serverlist *));
+    mcf->due.before = due_before;
+    if (mcf->run_queue.elts == NULL || mcf->due.elts == NULL) {
+        return NGX_ERROR;
     }
 
     for (i = 0; i < mcf->service_concurrency; i++) {
         service_conn *sc = ngx_array_push(&mcf->service_conns);
         ngx_memzero(sc, sizeof *sc);
 
-        sc->send.start = ngx_pcalloc(mcf->conf_pool, MAX_HTTP_REQUEST_SIZE);
+        sc->send.start = ngx_pcalloc(mcf->conf_pool,
+            mcf->request_size * mcf->service_pipeline);
         if (sc->send.start == NULL) {
             ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
                 "upstream-serverlist: allocate send buffer failed");
             return NGX_ERROR;
         }
-        sc->send.end = sc->send.start + MAX_HTTP_REQUEST_SIZE;
+        sc->send.end = sc->send.start
+            + mcf->request_size * mcf->service_pipeline;
         sc->send.last = sc->send.pos = sc->send.start;
 
-        sc->recv.start = ngx_pcalloc(mcf->conf_pool, ngx_pagesize);
-        if (sc->recv.start == NULL) {
-            ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
-                "upstream-serverlist: allocate recv buffer failed");
-            return NGX_ERROR;
-        }
-        sc->recv.end = sc->recv.start + MAX_HTTP_REQUEST_SIZE;
-        sc->recv.last = sc->recv.pos = sc->recv.start;
+        // recv buffer is held only during a round, see hold_recv_buf().
 
         ngx_memzero(&sc->peer_conn, sizeof sc->peer_conn);
         sc->peer_conn.data = NULL;
@@ -432,11 +1349,14 @@ init_process(ngx_cycle_t *cycle) {
         sc->peer_conn.sockaddr = &mcf->service_url.sockaddr.sockaddr;
         sc->peer_conn.socklen = mcf->service_url.socklen;
 
-        sc->serverlists_start = ngx_min(mcf->serverlists.nelts,
-            0 + blocksize * i);
-        sc->serverlists_end = ngx_min(mcf->serverlists.nelts,
-            sc->serverlists_start + blocksize);
-        sc->serverlists_curr = sc->serverlists_start;
+        sc->nclaimed = mcf->service_pipeline * ngx_max(mcf->service_batch, 1);
+        sc->claimed = ngx_pcalloc(mcf->conf_pool,
+            sc->nclaimed * sizeof(serverlist *));
+        sc->claimed_count = ngx_pcalloc(mcf->conf_pool,
+            sc->nclaimed * sizeof(ngx_uint_t));
+        if (sc->claimed == NULL || sc->claimed_count == NULL) {
+            return NGX_ERROR;
+        }
     }
 
     for (i = 0; i < mcf->service_conns.nelts; i++) {
@@ -448,15 +1368,83 @@ init_process(ngx_cycle_t *cycle) {
         sc->refresh_timer.handler = connect_to_service;
         sc->refresh_timer.log = cycle->log;
         sc->refresh_timer.data = sc;
+    }
+
+    mcf->refresh_timer.handler = refresh_due;
+    mcf->refresh_timer.log = cycle->log;
+    mcf->refresh_timer.data = mcf;
+
+    for (i = 0; i < mcf->serverlists.nelts; i++) {
+        sl = (serverlist *)mcf->serverlists.elts + i;
+        schedule_serverlist(mcf, sl, random_interval_of(sl));
+    }
 
-        if ((ngx_uint_t)sc->serverlists_start < mcf->serverlists.nelts) {
-            ngx_add_timer(&sc->refresh_timer, random_interval_ms());
+    return NGX_OK;
+}
+
+// takes a recv buffer of ngx_pagesize from the ones this worker freed, unless
+// sc holds one already. buffers are allocated only when all are held.
+static ngx_int_t
+hold_recv_buf(main_conf *mcf, service_conn *sc, ngx_log_t *log) {
+    ngx_chain_t *cl = sc->recv_cl;
+
+    if (cl != NULL) {
+        return NGX_OK;
+    }
+
+    cl = mcf->free_recv_bufs;
+    if (cl != NULL) {
+        mcf->free_recv_bufs = cl->next;
+    } else {
+        cl = ngx_alloc_chain_link(mcf->conf_pool);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        cl->buf = ngx_calloc_buf(mcf->conf_pool);
+        if (cl->buf == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (cl->buf->start == NULL) {
+        cl->buf->start = ngx_alloc(ngx_pagesize, log);
+        if (cl->buf->start == NULL) {
+            cl->next = mcf->free_recv_bufs;
+            mcf->free_recv_bufs = cl;
+            return NGX_ERROR;
         }
+        cl->buf->end = cl->buf->start + ngx_pagesize;
     }
 
+    cl->next = NULL;
+    sc->recv_cl = cl;
+    sc->recv.start = cl->buf->start;
+    sc->recv.end = cl->buf->end;
+    sc->recv.pos = sc->recv.last = sc->recv.start;
     return NGX_OK;
 }
 
+// gives the recv buffer of sc back. a buffer grown for a long line is freed,
+// so only buffers of ngx_pagesize are kept.
+static void
+release_recv_buf(main_conf *mcf, service_conn *sc) {
+    ngx_chain_t *cl = sc->recv_cl;
+
+    if (cl == NULL) {
+        return;
+    }
+
+    if (cl->buf->start == NULL) {
+        ngx_free(sc->recv.start);
+    }
+
+    ngx_memzero(&sc->recv, sizeof sc->recv);
+    sc->recv_cl = NULL;
+    cl->next = mcf->free_recv_bufs;
+    mcf->free_recv_bufs = cl;
+}
+
 static void
 empty_handler(ngx_event_t *ev) {
     ngx_log_debug(NGX_LOG_DEBUG_ALL, ev->log, 0,
@@ -496,135 +1484,507 @@ close:
     sc->peer_conn.connection = NULL;
 }
 
+// drops the servers parsed so far of the section being parsed.
 static void
-refresh_timeout_handler(ngx_event_t *ev) {
-    main_conf *mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
-        ngx_http_upstream_serverlist_module);
-    service_conn *sc = ev->data;
-    serverlist *sl = NULL;
+abort_section(service_conn *sc) {
+    if (sc->section != NULL && sc->section->new_pool != NULL) {
+        ngx_destroy_pool(sc->section->new_pool);
+        sc->section->new_pool = NULL;
+    }
 
-    if (whole_world_exiting()) {
-        return;
+    sc->section = NULL;
+    sc->section_servers = NULL;
+}
+
+// prepares sc to receive the next response from its first byte.
+static void
+reset_response(service_conn *sc) {
+    abort_section(sc);
+    sc->phase = SERVICE_PHASE_HEADER;
+    sc->header_scanned = 0;
+    sc->status = 0;
+    ngx_str_null(&sc->etag);
+    sc->response_count = 0;
+    ngx_memzero(&sc->body, sizeof sc->body);
+    sc->content_length = -1;
+    sc->body_rest = 0;
+    sc->body_done = 0;
+    sc->chunked = 0;
+}
+
+// with a shared zone, one worker at a time fetches serverlist sl, the one
+// holding its lease, and publishes it. returns 1 if the lease is taken or
+// renewed by this worker.
+static ngx_int_t
+take_lease(main_conf *mcf, serverlist *sl) {
+    shared_list *shl = sl->shared;
+    ngx_int_t taken = 0;
+
+    if (shl == NULL) {
+        return 1;
     }
 
-    ngx_log_error(NGX_LOG_ERR, ev->log, 0,
-        "upstream-serverlist: refresh timeout start %d end %d curr %d",
-        sc->serverlists_start, sc->serverlists_end, sc->serverlists_curr);
+    // a racy peek, so that workers checking often in watch mode mostly do
+    // not lock.
+    if (shl->lease_owner != ngx_pid &&
+            (ngx_msec_int_t)(shl->lease_expire - ngx_current_msec) > 0) {
+        return 0;
+    }
 
-    if (sc->peer_conn.connection) {
-        ngx_close_connection(sc->peer_conn.connection);
-        sc->peer_conn.connection = NULL;
+    ngx_shmtx_lock(&mcf->shpool->mutex);
+
+    if (shl->lease_owner == ngx_pid ||
+            (ngx_msec_int_t)(shl->lease_expire - ngx_current_msec) <= 0) {
+        // lasts over the next round, unless the owner is gone.
+        shl->lease_owner = ngx_pid;
+        shl->lease_expire = ngx_current_msec + timeout_of(sl)
+            + interval_of(sl) + DEFAULT_SHARED_LEASE_MS;
+        taken = 1;
     }
 
-    sl = (serverlist *)mcf->serverlists.elts + sc->serverlists_curr;
-    if (sl->new_pool) {
-        ngx_destroy_pool(sl->new_pool);
-        sl->new_pool = NULL;
+    ngx_shmtx_unlock(&mcf->shpool->mutex);
+    return taken;
+}
+
+static ngx_int_t
+due_before(serverlist *a, serverlist *b) {
+    return (ngx_msec_int_t)(a->due - b->due) < 0;
+}
+
+// serverlists of higher priority are claimed first, then the ones due first.
+static ngx_int_t
+priority_before(serverlist *a, serverlist *b) {
+    if (a->priority != b->priority) {
+        return a->priority > b->priority;
     }
 
-    ngx_add_timer(&sc->refresh_timer, random_interval_ms());
+    return due_before(a, b);
 }
 
 static void
-connect_to_service(ngx_event_t *ev) {
-    ngx_int_t ret = -1;
-    service_conn *sc = ev->data;
-    ngx_connection_t *c = NULL;
+set_heap(serverlist_heap *h, ngx_uint_t i, serverlist *sl) {
+    h->elts[i] = sl;
+    sl->heap_index = i;
+}
 
-    if (whole_world_exiting()) {
-        return;
+static void
+sift_heap_up(serverlist_heap *h, ngx_uint_t i) {
+    serverlist *sl = h->elts[i];
+    ngx_uint_t parent = 0;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!h->before(sl, h->elts[parent])) {
+            break;
+        }
+        set_heap(h, i, h->elts[parent]);
+        i = parent;
     }
 
-    ngx_log_error(NGX_LOG_DEBUG, ev->log, 0,
-        "upstream-serverlist: create connection for serverlists from %d to %d, "
-        "cursor %d", sc->serverlists_start, sc->serverlists_end,
-        sc->serverlists_curr);
+    set_heap(h, i, sl);
+}
 
-    if (sc->start_time.sec <= 0) {
-        sc->start_time = *ngx_timeofday();
+static void
+sift_heap_down(serverlist_heap *h, ngx_uint_t i) {
+    serverlist *sl = h->elts[i];
+    ngx_uint_t child = 0;
+
+    while ((child = 2 * i + 1) < h->nelts) {
+        if (child + 1 < h->nelts &&
+                h->before(h->elts[child + 1], h->elts[child])) {
+            child++;
+        }
+        if (!h->before(h->elts[child], sl)) {
+            break;
+        }
+        set_heap(h, i, h->elts[child]);
+        i = child;
     }
 
-    c = sc->peer_conn.connection;
-    if (c && c->read->ready) {
-        c->read->handler(c->read);
+    set_heap(h, i, sl);
+}
+
+static void
+push_heap(serverlist_heap *h, serverlist *sl) {
+    set_heap(h, h->nelts++, sl);
+    sift_heap_up(h, sl->heap_index);
+}
+
+static serverlist *
+pop_heap(serverlist_heap *h) {
+    serverlist *sl = h->elts[0];
+
+    if (--h->nelts > 0) {
+        set_heap(h, 0, h->elts[h->nelts]);
+        sift_heap_down(h, 0);
     }
 
-    if (!c) {
-        ret = ngx_event_connect_peer(&sc->peer_conn);
-        if (ret != NGX_DONE && ret != NGX_OK && ret != NGX_AGAIN) {
-            ngx_log_error(NGX_LOG_ERR, ev->log, 0,
-                "upstream-serverlist: connect to service url failed: %V",
-                sc->peer_conn.name);
-            ngx_add_timer(&sc->refresh_timer, random_interval_ms());
-            return;
-        }
+    return sl;
+}
+
+static void
+queue_serverlist(main_conf *mcf, serverlist *sl) {
+    if (sl->queued) {
+        return;
     }
 
-    ngx_memzero(&sc->body, sizeof sc->body);
-    sc->recv.pos = sc->recv.last = sc->recv.start;
-    sc->send.pos = sc->send.last = sc->send.start;
-    sc->content_length = -1;
+    sl->queued = 1;
+    push_heap(&mcf->run_queue, sl);
+}
 
-    c = sc->peer_conn.connection;
-    c->data = sc;
-    c->sendfile = 0;
-    c->sent = 0;
-    c->idle = 1; // for quick exit.
-    c->log = sc->peer_conn.log;
-    c->write->log = c->log;
-    c->read->log = c->log;
-    c->write->handler = send_to_service;
-    c->read->handler = recv_from_service;
+// claims up to n serverlists of the run queue for the next request of sc,
+// returns how many are claimed.
+static ngx_uint_t
+claim_serverlists(main_conf *mcf, service_conn *sc, ngx_uint_t n) {
+    ngx_uint_t i = 0, first = sc->serverlists_sent;
 
-    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
-        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
-            "upstream-serverlist: handle write event failed");
-        goto fail;
+    for (i = 0; i < n && mcf->run_queue.nelts > 0; i++) {
+        sc->claimed[(first + i) % sc->nclaimed] = pop_heap(&mcf->run_queue);
     }
 
-    if (ngx_del_event(c->read, NGX_READ_EVENT, 0) != NGX_OK) {
-        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
-            "upstream-serverlist: del read event failed");
-        goto fail;
+    sc->claimed_count[first % sc->nclaimed] = i;
+    mcf->in_flight += i;
+    return i;
+}
+
+static serverlist *
+claimed_serverlist(service_conn *sc, ngx_uint_t i) {
+    return sc->claimed[i % sc->nclaimed];
+}
+
+// the request of sc from its serverlist first may take the longest timeout
+// of the serverlists in it.
+static ngx_msec_t
+claimed_timeout_ms(service_conn *sc, ngx_uint_t first) {
+    ngx_msec_t timeout = 0;
+    ngx_uint_t i = 0, count = sc->claimed_count[first % sc->nclaimed];
+
+    for (i = first; i < first + count; i++) {
+        timeout = ngx_max(timeout, timeout_of(claimed_serverlist(sc, i)));
     }
 
-    if (ret == NGX_OK) {
-        c->write->handler(c->write);
+    return timeout;
+}
+
+// arms the refresh timer at the first due time, exactly, as ngx_add_timer()
+// may keep a timer set a bit later.
+static void
+arm_refresh_timer(main_conf *mcf) {
+    ngx_msec_int_t delay = 0;
+
+    if (mcf->refresh_timer.timer_set) {
+        ngx_del_timer(&mcf->refresh_timer);
     }
 
-    return;
+    if (mcf->due.nelts <= 0) {
+        return;
+    }
 
-fail:
-    ngx_close_connection(sc->peer_conn.connection);
-    sc->peer_conn.connection = NULL;
-    ngx_del_timer(&sc->timeout_timer);
-    ngx_add_timer(&sc->refresh_timer, random_interval_ms());
+    delay = mcf->due.elts[0]->due - ngx_current_msec;
+    ngx_add_timer(&mcf->refresh_timer, ngx_max(delay, 1));
 }
 
-// copy from ngx_http_ustream.c
-static ngx_int_t
-test_connect(ngx_connection_t *c) {
-    int        err;
-    socklen_t  len;
+// puts sl into the due heap, to be queued after delay.
+static void
+schedule_serverlist(main_conf *mcf, serverlist *sl, ngx_msec_t delay) {
+    sl->queued = 0;
+    sl->due = ngx_current_msec + delay;
+    push_heap(&mcf->due, sl);
 
-#if (NGX_HAVE_KQUEUE)
+    if (sl->heap_index == 0) {
+        arm_refresh_timer(mcf);
+    }
+}
 
-    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
-        if (c->write->pending_eof || c->read->pending_eof) {
-            if (c->write->pending_eof) {
-                err = c->write->kq_errno;
+// when sl is due again after its response. in watch mode the service held the
+// request until something changed, so it is due at once, unless it looks like
+// the service does not watch. a failing one backs off.
+static ngx_msec_t
+next_due_ms(serverlist *sl, ngx_uint_t failed) {
+    ngx_uint_t missed = sl->index_missed;
 
-            } else {
-                err = c->read->kq_errno;
-            }
+    sl->index_missed = 0;
 
-            c->log->action = "connecting to upstream";
-            (void) ngx_connection_error(c, err,
-                                    "kevent() reported that connect() failed");
-            return NGX_ERROR;
-        }
+    if (failed) {
+        sl->failures++;
+        return random_interval_of(sl)
+            << ngx_min(sl->failures - 1, MAX_BACKOFF_SHIFT);
+    }
 
-    } else
+    sl->failures = 0;
+    return watch_timeout_ms > 0 && !missed ? 1 : random_interval_of(sl);
+}
+
+// gives the serverlists of the response of sc just received back, each one is
+// scheduled again on its own.
+static void
+unclaim_response(main_conf *mcf, service_conn *sc) {
+    serverlist *sl = NULL;
+    ngx_uint_t i = 0, failed = sc->status != 200 && sc->status != 304;
+
+    for (i = 0; i < sc->response_count; i++) {
+        sl = claimed_serverlist(sc, sc->serverlists_curr + i);
+        if (mcf->share) {
+            take_lease(mcf, sl);
+        }
+        schedule_serverlist(mcf, sl, next_due_ms(sl, failed));
+    }
+
+    mcf->in_flight -= sc->response_count;
+    sc->serverlists_curr += sc->response_count;
+    sc->requests--;
+}
+
+// starts a timer of every idle service_conn, to claim what is queued.
+static void
+wake_service_conns(main_conf *mcf) {
+    service_conn *sc = NULL;
+    ngx_uint_t i = 0;
+
+    for (i = 0; i < mcf->service_conns.nelts; i++) {
+        sc = (service_conn *)mcf->service_conns.elts + i;
+        if (!sc->busy && !sc->refresh_timer.timer_set) {
+            ngx_add_timer(&sc->refresh_timer, 1);
+        }
+    }
+}
+
+// queues the serverlists due, and those due soon to fetch them together, then
+// wakes the service_conns to claim them. a slow serverlist holds up only the
+// connection claimed it.
+static void
+refresh_due(ngx_event_t *ev) {
+    main_conf *mcf = ev->data;
+    serverlist *sl = NULL;
+    ngx_uint_t queued = 0, others = 0;
+
+    if (whole_world_exiting()) {
+        return;
+    }
+
+    while (mcf->due.nelts > 0 && (ngx_msec_int_t)(mcf->due.elts[0]->due
+            - ngx_current_msec) <= (ngx_msec_int_t)due_slack_of(
+                mcf->due.elts[0])) {
+        sl = pop_heap(&mcf->due);
+
+        if (mcf->share) {
+            sync_serverlist(sl, ev->log);
+            if (!take_lease(mcf, sl)) {
+                // checked again when the owner may have published, or be
+                // gone.
+                others++;
+                schedule_serverlist(mcf, sl, watch_timeout_ms > 0
+                    ? ngx_min(interval_of(sl), WATCH_SYNC_MS)
+                    : random_interval_of(sl));
+                continue;
+            }
+        }
+
+        queue_serverlist(mcf, sl);
+        queued++;
+    }
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+        "upstream-serverlist: %d serverlists queued, %d fetched by another "
+        "worker, %d scheduled", queued, others, mcf->due.nelts);
+
+    if (queued > 0) {
+        wake_service_conns(mcf);
+    }
+
+    arm_refresh_timer(mcf);
+}
+
+// the connection of sc has nothing to claim or wait for, it idles until it is
+// woken. returns NGX_ERROR if it should be closed.
+static ngx_int_t
+rest_service_conn(main_conf *mcf, service_conn *sc, ngx_log_t *log) {
+    ngx_connection_t *c = sc->peer_conn.connection;
+
+    sc->busy = 0;
+    // another one may use the buffer.
+    release_recv_buf(mcf, sc);
+
+    if (sc->timeout_timer.timer_set) {
+        ngx_del_timer(&sc->timeout_timer);
+    }
+
+    c->write->handler = empty_handler;
+    c->read->handler = idle_conn_read_handler;
+
+    if (c->write->active && ngx_del_event(c->write, NGX_WRITE_EVENT, 0)
+            != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+            "upstream-serverlist: del write event failed");
+        return NGX_ERROR;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+            "upstream-serverlist: handle read event failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+// closes the connection of sc on a failure, serverlists it claimed back off
+// like failed responses, and it retries after delay.
+static void
+fail_service_conn(service_conn *sc, ngx_msec_t delay) {
+    main_conf *mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+        ngx_http_upstream_serverlist_module);
+    serverlist *sl = NULL;
+
+    if (sc->peer_conn.connection) {
+        ngx_close_connection(sc->peer_conn.connection);
+        sc->peer_conn.connection = NULL;
+    }
+
+    if (sc->timeout_timer.timer_set) {
+        ngx_del_timer(&sc->timeout_timer);
+    }
+
+    reset_response(sc);
+    release_recv_buf(mcf, sc);
+
+    for ( /* void */ ; sc->serverlists_curr < sc->serverlists_sent;
+            sc->serverlists_curr++) {
+        sl = claimed_serverlist(sc, sc->serverlists_curr);
+        schedule_serverlist(mcf, sl, next_due_ms(sl, 1));
+        mcf->in_flight--;
+    }
+
+    sc->send.pos = sc->send.last = sc->send.start;
+    sc->requests = 0;
+    sc->busy = 0;
+    ngx_add_timer(&sc->refresh_timer, delay);
+}
+
+static void
+refresh_timeout_handler(ngx_event_t *ev) {
+    service_conn *sc = ev->data;
+
+    if (whole_world_exiting()) {
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+        "upstream-serverlist: refresh timeout, %d serverlists in flight",
+        sc->serverlists_sent - sc->serverlists_curr);
+
+    fail_service_conn(sc, random_interval_ms());
+}
+
+static void
+connect_to_service(ngx_event_t *ev) {
+    main_conf *mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+        ngx_http_upstream_serverlist_module);
+    ngx_int_t ret = -1;
+    service_conn *sc = ev->data;
+    ngx_connection_t *c = NULL;
+
+    if (whole_world_exiting()) {
+        return;
+    }
+
+    if (mcf->run_queue.nelts <= 0) {
+        // nothing due, it is woken once some serverlists are queued.
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_DEBUG, ev->log, 0,
+        "upstream-serverlist: create connection for %d queued serverlists",
+        mcf->run_queue.nelts);
+
+    sc->busy = 1;
+
+    c = sc->peer_conn.connection;
+    if (c && c->read->ready) {
+        // closes it if the service did.
+        c->read->handler(c->read);
+        c = sc->peer_conn.connection;
+    }
+
+    if (!c) {
+        ret = ngx_event_connect_peer(&sc->peer_conn);
+        if (ret != NGX_DONE && ret != NGX_OK && ret != NGX_AGAIN) {
+            ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                "upstream-serverlist: connect to service url failed: %V",
+                sc->peer_conn.name);
+            fail_service_conn(sc, random_interval_ms());
+            return;
+        }
+    }
+
+    if (hold_recv_buf(mcf, sc, ev->log) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+            "upstream-serverlist: allocate recv buffer failed");
+        goto fail;
+    }
+
+    // claims are made once the connection is writable.
+    reset_response(sc);
+    sc->recv.pos = sc->recv.last = sc->recv.start;
+    sc->send.pos = sc->send.last = sc->send.start;
+
+    c = sc->peer_conn.connection;
+    c->data = sc;
+    c->sendfile = 0;
+    c->sent = 0;
+    c->idle = 1; // for quick exit.
+    c->log = sc->peer_conn.log;
+    c->write->log = c->log;
+    c->read->log = c->log;
+    c->write->handler = send_to_service;
+    c->read->handler = recv_from_service;
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+            "upstream-serverlist: handle write event failed");
+        goto fail;
+    }
+
+    if (ngx_del_event(c->read, NGX_READ_EVENT, 0) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+            "upstream-serverlist: del read event failed");
+        goto fail;
+    }
+
+    if (ret == NGX_OK) {
+        c->write->handler(c->write);
+    }
+
+    return;
+
+fail:
+    fail_service_conn(sc, random_interval_ms());
+}
+
+// copy from ngx_http_ustream.c
+static ngx_int_t
+test_connect(ngx_connection_t *c) {
+    int        err;
+    socklen_t  len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        if (c->write->pending_eof || c->read->pending_eof) {
+            if (c->write->pending_eof) {
+                err = c->write->kq_errno;
+
+            } else {
+                err = c->read->kq_errno;
+            }
+
+            c->log->action = "connecting to upstream";
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+    } else
 #endif
     {
         err = 0;
@@ -651,78 +2011,157 @@ test_connect(ngx_connection_t *c) {
     return NGX_OK;
 }
 
+static u_char *
+build_request(u_char *p, u_char *end, serverlist *sl) {
+    main_conf *mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+        ngx_http_upstream_serverlist_module);
+
+    p = ngx_slprintf(p, end, "GET %V%s%V", &mcf->service_url.uri,
+        mcf->service_url.uri.data[mcf->service_url.uri.len - 1] == '/'
+            ? "" : "/", &sl->name);
+
+    if (watch_timeout_ms > 0) {
+        // blocking query, like consul's.
+        p = ngx_slprintf(p, end, "?index=%O&wait=%ims", sl->index,
+            watch_timeout_ms);
+    }
+
+    p = ngx_slprintf(p, end, " HTTP/1.1\r\n");
+
+    if (mcf->service_url.family == AF_UNIX) {
+        p = ngx_slprintf(p, end, "Host: localhost\r\n");
+    } else {
+        p = ngx_slprintf(p, end, "Host: %V\r\n", &mcf->service_url.host);
+    }
+
+    if (sl->last_modified >= 0) {
+        u_char buf[64] = {0};
+
+        ngx_memzero(buf, sizeof buf);
+        ngx_http_time(buf, sl->last_modified);
+        p = ngx_slprintf(p, end, "If-Modified-Since: %s\r\n", buf);
+    }
+
+    if (sl->etag.len > 0) {
+        p = ngx_slprintf(p, end, "If-None-Match: %V\r\n", &sl->etag);
+    }
+
+    return ngx_slprintf(p, end, "Connection: Keep-Alive\r\n\r\n");
+}
+
+// asks for count serverlists claimed by sc from first in one request, each
+// body line carries a name, the validators of it, '-' if absent, and its index.
+static u_char *
+build_batch_request(u_char *p, u_char *end, service_conn *sc, ngx_uint_t first,
+    ngx_uint_t count) {
+    main_conf *mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+        ngx_http_upstream_serverlist_module);
+    serverlist *sl = NULL;
+    u_char *body = p + MAX_HTTP_REQUEST_SIZE, *last = body;
+    ngx_uint_t i = 0;
+
+    for (i = first; i < first + count; i++) {
+        sl = claimed_serverlist(sc, i);
+        last = ngx_slprintf(last, end, "%V ", &sl->name);
+        if (sl->etag.len > 0) {
+            last = ngx_slprintf(last, end, "%V ", &sl->etag);
+        } else {
+            last = ngx_slprintf(last, end, "- ");
+        }
+
+        if (sl->last_modified >= 0) {
+            last = ngx_slprintf(last, end, "%T", sl->last_modified);
+        } else {
+            last = ngx_slprintf(last, end, "-");
+        }
+
+        last = ngx_slprintf(last, end, " %O\n", sl->index);
+    }
+
+    p = ngx_slprintf(p, body, "POST %V", &mcf->service_url.uri);
+    if (watch_timeout_ms > 0) {
+        p = ngx_slprintf(p, body, "?wait=%ims", watch_timeout_ms);
+    }
+    p = ngx_slprintf(p, body, " HTTP/1.1\r\n");
+
+    if (mcf->service_url.family == AF_UNIX) {
+        p = ngx_slprintf(p, body, "Host: localhost\r\n");
+    } else {
+        p = ngx_slprintf(p, body, "Host: %V\r\n", &mcf->service_url.host);
+    }
+
+    p = ngx_slprintf(p, body, "Content-Type: text/plain\r\n"
+        "Content-Length: %uz\r\nConnection: Keep-Alive\r\n\r\n",
+        (size_t)(last - body));
+
+    return ngx_movemem(p, body, last - body);
+}
+
 static void
 send_to_service(ngx_event_t *ev) {
     main_conf *mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
         ngx_http_upstream_serverlist_module);
     ngx_connection_t *c = ev->data;
     service_conn *sc = c->data;
-    serverlist *sl = NULL;
     ssize_t ret = -1;
+    ngx_uint_t count = 0;
 
     if (whole_world_exiting()) {
         return;
     }
 
-    if (sc->serverlists_curr >= sc->serverlists_end) {
-        ngx_log_error(NGX_LOG_CRIT, ev->log, 0,
-            "upstream-serverlist: cursor %d exceed serverlists upper "
-            "bound %d", sc->serverlists_curr, sc->serverlists_end);
-        sc->serverlists_curr = sc->serverlists_start;
-        goto fail;
-    }
-
     ngx_log_error(NGX_LOG_DEBUG, ev->log, 0,
-        "upstream-serverlist: send begin cur %d start %d end %d act %d ready %d",
-        sc->serverlists_curr, sc->serverlists_start, sc->serverlists_end,
-        c->write->active, c->write->ready);
+        "upstream-serverlist: send begin cur %d sent %d queued %d "
+        "act %d ready %d", sc->serverlists_curr, sc->serverlists_sent,
+        mcf->run_queue.nelts, c->write->active, c->write->ready);
 
     c->write->ready = 0;
-    ngx_add_timer(&sc->timeout_timer, refresh_timeout_ms);
 
     if (sc->send.last == sc->send.start) {
-        sl = (serverlist *)mcf->serverlists.elts + sc->serverlists_curr;
-        if (sc->serverlists_curr == 0 && test_connect(c) != NGX_OK) {
+        if (sc->serverlists_sent == sc->serverlists_curr &&
+                test_connect(c) != NGX_OK) {
             ngx_log_error(NGX_LOG_ERR, ev->log, 0,
-                "upstream-serverlist: serverlist %V test connect failed",
-                &sl->name);
+                "upstream-serverlist: test connect failed");
             goto fail;
         }
 
-        // build request.
+        // claim and build requests, at most service_pipeline of them in
+        // flight.
         sc->send.last = sc->send.pos = sc->send.start;
-        sc->send.last = ngx_snprintf(sc->send.last,
-            sc->send.end - sc->send.last,
-            "GET %V%s%V HTTP/1.1\r\n", &mcf->service_url.uri,
-            mcf->service_url.uri.data[mcf->service_url.uri.len - 1] == '/'
-                ? "" : "/", &sl->name);
-
-        if (mcf->service_url.family == AF_UNIX) {
-            sc->send.last = ngx_snprintf(sc->send.last,
-                sc->send.end - sc->send.last, "Host: localhost\r\n");
-        } else {
-            sc->send.last = ngx_snprintf(sc->send.last,
-                sc->send.end - sc->send.last, "Host: %V\r\n",
-                &mcf->service_url.host);
-        }
+        while (sc->requests < mcf->service_pipeline &&
+                (size_t)(sc->send.end - sc->send.last) >= mcf->request_size) {
+            count = claim_serverlists(mcf, sc,
+                ngx_max(mcf->service_batch, 1));
+            if (count == 0) {
+                break;
+            }
 
-        if (sl->last_modified >= 0) {
-            u_char buf[64] = {0};
+            if (mcf->service_batch) {
+                sc->send.last = build_batch_request(sc->send.last,
+                    sc->send.last + mcf->request_size, sc,
+                    sc->serverlists_sent, count);
+            } else {
+                sc->send.last = build_request(sc->send.last,
+                    sc->send.last + mcf->request_size,
+                    claimed_serverlist(sc, sc->serverlists_sent));
+            }
 
-            ngx_memzero(buf, sizeof buf);
-            ngx_http_time(buf, sl->last_modified);
-            sc->send.last = ngx_snprintf(sc->send.last,
-                sc->send.end - sc->send.last, "If-Modified-Since: %s\r\n", buf);
+            sc->serverlists_sent += count;
+            sc->requests++;
         }
 
-        if (sl->etag.len > 0) {
-            sc->send.last = ngx_snprintf(sc->send.last,
-                sc->send.end - sc->send.last, "If-None-Match: %V\r\n",
-                &sl->etag);
+        if (sc->serverlists_sent == sc->serverlists_curr) {
+            // other connections claimed all.
+            if (rest_service_conn(mcf, sc, ev->log) != NGX_OK) {
+                goto fail;
+            }
+            return;
         }
+    }
 
-        sc->send.last = ngx_snprintf(sc->send.last,
-            sc->send.end - sc->send.last, "Connection: Keep-Alive\r\n\r\n");
+    if (sc->send.pos < sc->send.last) {
+        ngx_add_timer(&sc->timeout_timer,
+            claimed_timeout_ms(sc, sc->serverlists_curr));
     }
 
     while (sc->send.pos < sc->send.last) {
@@ -757,16 +2196,13 @@ send_to_service(ngx_event_t *ev) {
     }
 
     ngx_log_error(NGX_LOG_DEBUG, ev->log, 0,
-        "upstream-serverlist: send end cur %d start %d end %d act %d ready %d",
-        sc->serverlists_curr, sc->serverlists_start, sc->serverlists_end,
-        c->write->active, c->write->ready);
+        "upstream-serverlist: send end cur %d sent %d queued %d "
+        "act %d ready %d", sc->serverlists_curr, sc->serverlists_sent,
+        mcf->run_queue.nelts, c->write->active, c->write->ready);
     return;
 
 fail:
-    ngx_close_connection(sc->peer_conn.connection);
-    sc->peer_conn.connection = NULL;
-    ngx_del_timer(&sc->timeout_timer);
-    ngx_add_timer(&sc->refresh_timer, random_interval_ms());
+    fail_service_conn(sc, random_interval_ms());
 }
 
 static int
@@ -800,183 +2236,422 @@ get_one_arg(u_char *buf, u_char *buf_end, ngx_str_t *arg) {
     return arg_end;
 }
 
-static u_char *
-get_one_line(u_char *buf, u_char *buf_end, ngx_str_t *line) {
-    u_char *pos = ngx_strlchr(buf, buf_end, '\n');
-    line->data = buf;
-    line->len = pos == NULL ? buf_end - buf : pos - buf;
-    return pos == NULL ? buf_end : pos + 1;
-}
+// copies addrs into the interned addresses of text, with no reference yet.
+static interned_addrs *
+intern_addrs(main_conf *mcf, ngx_str_t *text, uint32_t hash,
+    ngx_addr_t *addrs, ngx_uint_t naddrs) {
+    interned_addrs *ia = NULL;
+    size_t size = sizeof *ia + naddrs * sizeof(ngx_addr_t) + text->len;
+    u_char *p = NULL;
+    ngx_uint_t j = 0;
+
+    for (j = 0; j < naddrs; j++) {
+        size += NGX_ALIGNMENT + addrs[j].socklen + addrs[j].name.len;
+    }
 
-static ngx_array_t *
-get_servers(ngx_pool_t *pool, ngx_str_t *body, ngx_log_t *log) {
-    ngx_int_t ret = -1;
-    // this is the pool that needs to be cleared
-    ngx_array_t *servers = ngx_array_create(pool, 2,
-        sizeof(ngx_http_upstream_server_t));
-    ngx_http_upstream_server_t *server = NULL;
-    ngx_url_t u;
-    ngx_str_t curr_line = {0};
-    ngx_str_t curr_arg = {0};
+    ia = ngx_alloc(size, ngx_cycle->log);
+    if (ia == NULL) {
+        return NULL;
+    }
 
-    u_char *body_pos = body->data;
-    u_char *body_end = body->data + body->len;
-
-    do {
-        ngx_memzero(&curr_line, sizeof curr_line);
-        body_pos = get_one_line(body_pos, body_end, &curr_line);
-        ngx_int_t first_arg_found = 0;
-        ngx_int_t second_arg_found = 0;
-        u_char *line_pos = curr_line.data;
-        u_char *line_end = curr_line.data + curr_line.len;
-        while ((line_pos = get_one_arg(line_pos, line_end,
-                &curr_arg)) != NULL) {
-            if (!first_arg_found) {
-                if (ngx_strncmp(curr_arg.data, "server", curr_arg.len) != 0) {
-                    ngx_log_error(NGX_LOG_ERR, log, 0,
-                        "upstream-serverlist: expect 'server' prefix");
-                    break;
-                }
+    ia->refs = 0;
+    ia->naddrs = naddrs;
+    ia->addrs = (ngx_addr_t *)(ia + 1);
+    p = (u_char *)(ia->addrs + naddrs);
+
+    for (j = 0; j < naddrs; j++) {
+        p = ngx_align_ptr(p, NGX_ALIGNMENT);
+        ia->addrs[j].sockaddr = (struct sockaddr *)p;
+        ia->addrs[j].socklen = addrs[j].socklen;
+        p = ngx_cpymem(p, addrs[j].sockaddr, addrs[j].socklen);
+        ia->addrs[j].name.data = p;
+        ia->addrs[j].name.len = addrs[j].name.len;
+        p = ngx_cpymem(p, addrs[j].name.data, addrs[j].name.len);
+    }
 
-                first_arg_found = 1;
-            } else if (!second_arg_found) {
-                ngx_memzero(&u, sizeof u);
-                u.url = curr_arg;
-                u.default_port = 80;
-                ret = ngx_parse_url(pool, &u);
-                if (ret != NGX_OK) {
-                    ngx_log_error(NGX_LOG_ERR, log, 0,
-                        "upstream-serverlist: parse addr %V failed", &curr_arg);
-                    break;
-                }
+    ia->sn.str.data = p;
+    ia->sn.str.len = text->len;
+    ngx_memcpy(p, text->data, text->len);
+    ia->sn.node.key = hash;
+    ngx_rbtree_insert(&mcf->interned, &ia->sn.node);
+    return ia;
+}
+
+static interned_addrs *
+lookup_addrs(main_conf *mcf, ngx_str_t *text, uint32_t hash) {
+    return (interned_addrs *)ngx_str_rbtree_lookup(&mcf->interned, text,
+        hash);
+}
+
+static void
+refer_addrs(interned_addrs *ia, ngx_http_upstream_server_t *server) {
+    ia->refs++;
+    server->name = ia->sn.str;
+    server->addrs = ia->addrs;
+    server->naddrs = ia->naddrs;
+}
+
+// releases the interned addresses servers of a generation refer to, once its
+// pool is destroyed. servers of nginx.conf and resolved hostnames are not
+// interned.
+static void
+release_servers(void *data) {
+    main_conf *mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+        ngx_http_upstream_serverlist_module);
+    ngx_array_t *servers = data;
+    ngx_http_upstream_server_t *s = servers->elts;
+    interned_addrs *ia = NULL;
+    ngx_uint_t i = 0;
+
+    for (i = 0; i < servers->nelts; i++) {
+        if (s[i].naddrs <= 0) {
+            continue;
+        }
+
+        ia = lookup_addrs(mcf, &s[i].name,
+            ngx_crc32_short(s[i].name.data, s[i].name.len));
+        if (ia == NULL || ia->addrs != s[i].addrs) {
+            continue;
+        }
+
+        if (--ia->refs == 0) {
+            ngx_rbtree_delete(&mcf->interned, &ia->sn.node);
+            ngx_free(ia);
+        }
+    }
+}
+
+// creates the servers array of a generation in pool.
+static ngx_array_t *
+create_servers(ngx_pool_t *pool, ngx_uint_t n) {
+    ngx_array_t *servers = ngx_array_create(pool, n,
+        sizeof(ngx_http_upstream_server_t));
+    ngx_pool_cleanup_t *cln = NULL;
+
+    if (servers == NULL) {
+        return NULL;
+    }
+
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    cln->handler = release_servers;
+    cln->data = servers;
+    return servers;
+}
+
+// sets name and addresses of server from the address text. an address seen
+// before in this worker is not parsed again, and its memory is shared. names
+// are kept in pool, hostnames are resolved later through the resolver, never
+// here in the event loop.
+static ngx_int_t
+parse_server_addr(ngx_pool_t *pool, ngx_str_t *text,
+    ngx_http_upstream_server_t *server, ngx_log_t *log) {
+    main_conf *mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+        ngx_http_upstream_serverlist_module);
+    uint32_t hash = ngx_crc32_short(text->data, text->len);
+    interned_addrs *ia = lookup_addrs(mcf, text, hash);
+    ngx_int_t ret = NGX_OK;
+    ngx_url_t u;
+
+    if (ia != NULL) {
+        refer_addrs(ia, server);
+        return NGX_OK;
+    }
+
+    // parsed in scratch memory, only the interned copy is kept.
+    ngx_memzero(&u, sizeof u);
+    u.url = *text;
+    u.default_port = 80;
+    u.no_resolve = 1;
+    ret = ngx_parse_url(mcf->intern_pool, &u);
+    if (ret == NGX_OK && u.naddrs <= 0 &&
+            ngx_inet_addr(u.host.data, u.host.len) != INADDR_NONE) {
+        // a literal address, no query is made.
+        ngx_memzero(&u, sizeof u);
+        u.url = *text;
+        u.default_port = 80;
+        ret = ngx_parse_url(mcf->intern_pool, &u);
+    }
+
+    if (ret != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+            "upstream-serverlist: parse addr %V failed", text);
+    } else if (u.naddrs <= 0) {
+        // a hostname, its addresses are of the generation.
+        server->name.len = text->len;
+        server->name.data = ngx_pstrdup(pool, text);
+        ret = server->name.data ? NGX_OK : NGX_ERROR;
+    } else {
+        ia = intern_addrs(mcf, text, hash, u.addrs, u.naddrs);
+        if (ia != NULL) {
+            refer_addrs(ia, server);
+        } else {
+            ret = NGX_ERROR;
+        }
+    }
+
+    ngx_reset_pool(mcf->intern_pool);
+    return ret;
+}
+
+// parses one "server" line into servers, allocated from pool.
+static void
+parse_server_line(ngx_pool_t *pool, ngx_array_t *servers, ngx_str_t *line,
+    ngx_log_t *log) {
+    ngx_int_t ret = -1;
+    ngx_http_upstream_server_t *server = NULL;
+    ngx_str_t curr_arg = {0};
+    ngx_int_t first_arg_found = 0;
+    ngx_int_t second_arg_found = 0;
+    u_char *line_pos = line->data;
+    u_char *line_end = line->data + line->len;
+
+    while ((line_pos = get_one_arg(line_pos, line_end, &curr_arg)) != NULL) {
+        if (!first_arg_found) {
+            if (ngx_strncmp(curr_arg.data, "server", curr_arg.len) != 0) {
+                ngx_log_error(NGX_LOG_ERR, log, 0,
+                    "upstream-serverlist: expect 'server' prefix");
+                return;
+            }
+
+            first_arg_found = 1;
+        } else if (!second_arg_found) {
+            server = ngx_array_push(servers);
+            if (server == NULL) {
+                return;
+            }
+
+            ngx_memzero(server, sizeof *server);
+            if (parse_server_addr(pool, &curr_arg, server, log) != NGX_OK) {
+                servers->nelts--;
+                return;
+            }
 
-                // this causes the memory leak when servers are never removed
-                server = ngx_array_push(servers);
-                ngx_memzero(server, sizeof *server);
-                server->name = u.url;
-                server->naddrs = u.naddrs;
-                server->addrs = u.addrs;
-                server->weight = 1;
+            server->weight = 1;
 #if nginx_version >= 1011005
-                server->max_conns = 0;
+            server->max_conns = 0;
 #endif
-                server->max_fails = 1;
-                server->fail_timeout = 10;
-
-                second_arg_found = 1;
-            } else if (ngx_strncmp(curr_arg.data, "weight=", 7) == 0) {
-                ret = ngx_atoi(curr_arg.data + 7, curr_arg.len - 7);
-                if (ret == NGX_ERROR || ret <= 0) {
-                    ngx_log_error(NGX_LOG_ERR, log, 0,
-                        "upstream-serverlist: weight invalid");
-                    continue;
-                }
+            server->max_fails = 1;
+            server->fail_timeout = 10;
+
+            second_arg_found = 1;
+        } else if (ngx_strncmp(curr_arg.data, "weight=", 7) == 0) {
+            ret = ngx_atoi(curr_arg.data + 7, curr_arg.len - 7);
+            if (ret == NGX_ERROR || ret <= 0) {
+                ngx_log_error(NGX_LOG_ERR, log, 0,
+                    "upstream-serverlist: weight invalid");
+                continue;
+            }
 
-                server->weight = ret;
+            server->weight = ret;
 #if nginx_version >= 1011005
-            } else if (ngx_strncmp(curr_arg.data, "max_conns=", 10) == 0) {
-                ret = ngx_atoi(curr_arg.data + 10, curr_arg.len - 10);
-                if (ret == NGX_ERROR) {
-                    ngx_log_error(NGX_LOG_ERR, log, 0,
-                        "upstream-serverlist: max_conns invalid");
-                    continue;
-                }
+        } else if (ngx_strncmp(curr_arg.data, "max_conns=", 10) == 0) {
+            ret = ngx_atoi(curr_arg.data + 10, curr_arg.len - 10);
+            if (ret == NGX_ERROR) {
+                ngx_log_error(NGX_LOG_ERR, log, 0,
+                    "upstream-serverlist: max_conns invalid");
+                continue;
+            }
 
-                server->max_conns = ret;
+            server->max_conns = ret;
 #endif
-            } else if (ngx_strncmp(curr_arg.data, "max_fails=", 10) == 0) {
-                ret = ngx_atoi(curr_arg.data + 10, curr_arg.len - 10);
-                if (ret == NGX_ERROR) {
-                    ngx_log_error(NGX_LOG_ERR, log,
-                        0,
-                        "upstream-serverlist: max_fails invalid");
-                    continue;
-                }
-
-                server->max_fails = ret;
-            } else if (ngx_strncmp(curr_arg.data, "fail_timeout=", 13) == 0) {
-                ngx_str_t time_str = {.data = curr_arg.data + 13,
-                    .len = curr_arg.len - 13};
-                ret = ngx_parse_time(&time_str, 1);
-                if (ret == NGX_ERROR) {
-                    ngx_log_error(NGX_LOG_ERR, log, 0,
-                        "upstream-serverlist: fail_timeout invalid");
-                    continue;
-                }
-
-                server->fail_timeout = ret;
-            } else if (ngx_strncmp(curr_arg.data, "down", 4) == 0) {
-                server->down = 1;
-            } else if (ngx_strncmp(curr_arg.data, "backup", 6) == 0) {
-                server->backup = 1;
-            } else if (curr_arg.len == 1 && curr_arg.data[0] == ';') {
+        } else if (ngx_strncmp(curr_arg.data, "max_fails=", 10) == 0) {
+            ret = ngx_atoi(curr_arg.data + 10, curr_arg.len - 10);
+            if (ret == NGX_ERROR) {
+                ngx_log_error(NGX_LOG_ERR, log,
+                    0,
+                    "upstream-serverlist: max_fails invalid");
                 continue;
-            } else {
+            }
+
+            server->max_fails = ret;
+        } else if (ngx_strncmp(curr_arg.data, "fail_timeout=", 13) == 0) {
+            ngx_str_t time_str = {.data = curr_arg.data + 13,
+                .len = curr_arg.len - 13};
+            ret = ngx_parse_time(&time_str, 1);
+            if (ret == NGX_ERROR) {
                 ngx_log_error(NGX_LOG_ERR, log, 0,
-                    "upstream-serverlist: unknown server option %V", &curr_arg);
+                    "upstream-serverlist: fail_timeout invalid");
+                continue;
             }
-        }
-    } while (body_pos < body_end);
 
-    return servers;
+            server->fail_timeout = ret;
+        } else if (ngx_strncmp(curr_arg.data, "down", 4) == 0) {
+            server->down = 1;
+        } else if (ngx_strncmp(curr_arg.data, "backup", 6) == 0) {
+            server->backup = 1;
+        } else if (curr_arg.len == 1 && curr_arg.data[0] == ';') {
+            continue;
+        } else {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                "upstream-serverlist: unknown server option %V", &curr_arg);
+        }
+    }
 }
 
 static ngx_int_t
-upstream_servers_changed(const ngx_array_t *old, const ngx_array_t *new) {
-    ngx_http_upstream_server_t *s1 = NULL, *s2 = NULL;
+same_server_addrs(const ngx_http_upstream_server_t *s1,
+    const ngx_http_upstream_server_t *s2) {
     ngx_addr_t *a1 = NULL, *a2 = NULL;
-    ngx_uint_t i = 0, j = 0, k = 0, l = 0;
+    ngx_uint_t k = 0, l = 0;
 
-    if (old->nelts != new->nelts) {
+    if (s1->addrs == s2->addrs && s1->naddrs == s2->naddrs) {
+        // interned, or the same server.
         return 1;
     }
 
-    for (i = 0; i < old->nelts; i++) {
-        s1 = (ngx_http_upstream_server_t *)old->elts + i;
-        for (j = 0; j < new->nelts; j++) {
-            s2 = (ngx_http_upstream_server_t *)new->elts + j;
-            if (s1->name.len != s2->name.len ||
-                ngx_memcmp(s1->name.data, s2->name.data, s1->name.len) != 0 ||
-                s1->weight != s2->weight ||
-                s1->naddrs != s2->naddrs ||
+    if (s1->name.len != s2->name.len ||
+        ngx_memcmp(s1->name.data, s2->name.data, s1->name.len) != 0 ||
+        s1->naddrs != s2->naddrs) {
+        return 0;
+    }
+
+    // a hostname usually has only a few addresses, but they may come in any
+    // order.
+    for (k = 0; k < s1->naddrs; k++) {
+        a1 = s1->addrs + k;
+        for (l = 0; l < s2->naddrs; l++) {
+            a2 = s2->addrs + l;
+            if (a1->socklen == a2->socklen &&
+                ngx_memcmp(a1->sockaddr, a2->sockaddr, a1->socklen) == 0) {
+                break;
+            }
+        }
+
+        if (l >= s2->naddrs) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// hash of the server identity, name and addresses. addresses are combined
+// order independently to match same_server_addrs().
+static uint32_t
+server_key_hash(const ngx_http_upstream_server_t *s) {
+    uint32_t hash = 0, crc = 0;
+    ngx_uint_t i = 0;
+
+    ngx_crc32_init(hash);
+    ngx_crc32_update(&hash, s->name.data, s->name.len);
+    ngx_crc32_final(hash);
+
+    for (i = 0; i < s->naddrs; i++) {
+        ngx_crc32_init(crc);
+        ngx_crc32_update(&crc, (u_char *)s->addrs[i].sockaddr,
+            s->addrs[i].socklen);
+        ngx_crc32_final(crc);
+        hash += crc;
+    }
+
+    return hash;
+}
+
+static ngx_int_t
+same_server_attrs(const ngx_http_upstream_server_t *s1,
+    const ngx_http_upstream_server_t *s2) {
+    return s1->weight == s2->weight &&
 #if nginx_version >= 1011005
-                s1->max_conns != s2->max_conns ||
+        s1->max_conns == s2->max_conns &&
 #endif
-                s1->max_fails != s2->max_fails ||
-                s1->fail_timeout != s2->fail_timeout ||
-                s1->backup != s2->backup ||
-                s1->down != s2->down) {
-                continue;
-            }
+        s1->max_fails == s2->max_fails &&
+        s1->fail_timeout == s2->fail_timeout &&
+        s1->backup == s2->backup &&
+        s1->down == s2->down;
+}
 
-            for (k = 0; k < s1->naddrs; k++) {
-                a1 = s1->addrs + k;
-                for (l = 0; l < s2->naddrs; l++) {
-                    a2 = s2->addrs + l;
-                    if (a1->name.len == a2->name.len &&
-                        ngx_memcmp(a1->name.data, a2->name.data,
-                            a1->name.len) == 0 &&
-                        a1->socklen == a2->socklen &&
-                        ngx_memcmp(a1->sockaddr, a2->sockaddr,
-                            sizeof *a1->sockaddr) == 0) {
-                        break;
-                    }
-                }
+// old servers are indexed by an open addressing table keyed on name and
+// addresses, so that the diff is O(n) instead of comparing every pair.
+// attributes are compared only between servers sharing the same key.
+static ngx_int_t
+diff_servers(ngx_pool_t *pool, const ngx_array_t *old, const ngx_array_t *new,
+    server_changes *changes) {
+    ngx_http_upstream_server_t *s1 = NULL, *s2 = NULL, **ps = NULL;
+    server_pair *pair = NULL;
+    ngx_uint_t *slots = NULL, *matched = NULL;
+    uint32_t *hashes = NULL, hash = 0;
+    ngx_uint_t i = 0, j = 0, mask = 0, nslots = 2;
+
+    if (ngx_array_init(&changes->added, pool, 4, sizeof(s1)) != NGX_OK ||
+        ngx_array_init(&changes->removed, pool, 4, sizeof(s1)) != NGX_OK ||
+        ngx_array_init(&changes->modified, pool, 4, sizeof *pair) != NGX_OK ||
+        ngx_array_init(&changes->unchanged, pool, old->nelts + 1,
+            sizeof *pair) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-                if (l >= s2->naddrs) {
-                    return 1;
-                }
+    while (nslots < old->nelts * 2) {
+        nslots <<= 1;
+    }
+    mask = nslots - 1;
+
+    // slots store index + 1 of old servers, 0 means empty.
+    slots = ngx_pcalloc(pool, nslots * sizeof *slots);
+    hashes = ngx_pcalloc(pool, (old->nelts + 1) * sizeof *hashes);
+    matched = ngx_pcalloc(pool, (old->nelts + 1) * sizeof *matched);
+    if (slots == NULL || hashes == NULL || matched == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < old->nelts; i++) {
+        s1 = (ngx_http_upstream_server_t *)old->elts + i;
+        hashes[i] = server_key_hash(s1);
+        for (j = hashes[i] & mask; slots[j]; j = (j + 1) & mask) {
+            /* void */
+        }
+        slots[j] = i + 1;
+    }
+
+    for (i = 0; i < new->nelts; i++) {
+        s2 = (ngx_http_upstream_server_t *)new->elts + i;
+        hash = server_key_hash(s2);
+        s1 = NULL;
+
+        for (j = hash & mask; slots[j]; j = (j + 1) & mask) {
+            if (!matched[slots[j] - 1] && hashes[slots[j] - 1] == hash &&
+                same_server_addrs((ngx_http_upstream_server_t *)old->elts
+                    + slots[j] - 1, s2)) {
+                s1 = (ngx_http_upstream_server_t *)old->elts + slots[j] - 1;
+                matched[slots[j] - 1] = 1;
+                break;
+            }
+        }
+
+        if (s1 == NULL) {
+            ps = ngx_array_push(&changes->added);
+            if (ps == NULL) {
+                return NGX_ERROR;
             }
+            *ps = s2;
+            continue;
+        }
 
-            break;
+        pair = ngx_array_push(same_server_attrs(s1, s2) ? &changes->unchanged
+            : &changes->modified);
+        if (pair == NULL) {
+            return NGX_ERROR;
         }
+        pair->old = s1;
+        pair->new = s2;
+    }
 
-        if (j >= new->nelts) {
-            return 1;
+    for (i = 0; i < old->nelts; i++) {
+        if (matched[i]) {
+            continue;
+        }
+
+        ps = ngx_array_push(&changes->removed);
+        if (ps == NULL) {
+            return NGX_ERROR;
         }
+        *ps = (ngx_http_upstream_server_t *)old->elts + i;
     }
 
-    return 0;
+    return NGX_OK;
 }
 
 static u_char *
@@ -1004,354 +2679,3180 @@ build_server_line(u_char *buf, size_t bufsize,
     return p;
 }
 
-static void
-dump_serverlist(serverlist *sl) {
-    main_conf *mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
-        ngx_http_upstream_serverlist_module);
-    u_char tmpfile[MAX_CONF_DUMP_PATH_LENGTH] = {0};
-    ngx_fd_t fd = -1;
+// ensures the dump buffer has n bytes free.
+static ngx_int_t
+grow_dump(dump_ctx *d, size_t n) {
+    u_char *p = NULL;
+    size_t size = 0;
+
+    if (d->size - d->len >= n) {
+        return NGX_OK;
+    }
+
+    size = ngx_max(ngx_max(d->size * 2, ngx_pagesize), d->len + n);
+    p = ngx_alloc(size, ngx_cycle->log);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (d->data != NULL) {
+        ngx_memcpy(p, d->data, d->len);
+        ngx_free(d->data);
+    }
+
+    d->data = p;
+    d->size = size;
+    return NGX_OK;
+}
+
+// serializes servers of sl into one buffer, kept for next dumps. the first
+// line, a comment to nginx, keeps validators of the servers for warm start,
+// see load_dump().
+static ngx_int_t
+build_dump(serverlist *sl, dump_ctx *d) {
     ngx_http_upstream_server_t *s = NULL;
-    u_char buf[DUMP_BUFFER_SIZE] = {0}, *p = NULL;
+    u_char *p = NULL, *end = NULL;
     ngx_uint_t i = 0;
-    ssize_t ret = -1;
 
-    if (mcf->conf_dump_dir.len <= 0) {
-        return;
-    } else if (!ngx_shmtx_trylock(&sl->dump_file_lock)) {
-        ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
-            "upstream-serverlist: another worker process %d is dumping",
-            *sl->dump_file_lock.lock);
-        return;
+    d->len = 0;
+
+    if (grow_dump(d, sizeof "# serverlist  etag= last_modified= index= "
+            "body_hash= body_len=\n" + sl->name.len + MAX_ETAG_LENGTH
+            + NGX_TIME_T_LEN + NGX_OFF_T_LEN + 16 + NGX_INT_T_LEN) != NGX_OK) {
+        return NGX_ERROR;
     }
 
-    ngx_snprintf(tmpfile, sizeof tmpfile, "%V/.%V.conf.tmp",
-        &mcf->conf_dump_dir, &sl->name);
-    fd = ngx_open_file(tmpfile, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
-        NGX_FILE_DEFAULT_ACCESS);
-    if (fd < 0) {
-        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
-            "upstream-serverlist: open dump file %s failed", tmpfile);
-        goto unlock;
+    p = d->data;
+    end = d->data + d->size;
+    p = ngx_slprintf(p, end, "# serverlist %V", &sl->name);
+    if (sl->etag.len > 0) {
+        p = ngx_slprintf(p, end, " etag=%V", &sl->etag);
+    }
+    if (sl->last_modified >= 0) {
+        p = ngx_slprintf(p, end, " last_modified=%T", sl->last_modified);
     }
+    if (sl->index > 0) {
+        p = ngx_slprintf(p, end, " index=%O", sl->index);
+    }
+    if (sl->body_hash_valid) {
+        p = ngx_slprintf(p, end, " body_hash=%016xL body_len=%uz",
+            sl->body_hash, sl->body_len);
+    }
+    *p++ = '\n';
+    d->len = p - d->data;
 
     for (i = 0; i < sl->upstream_conf->servers->nelts; i++) {
         s = (ngx_http_upstream_server_t *)sl->upstream_conf->servers->elts + i;
 
+        if (grow_dump(d, DUMP_BUFFER_SIZE) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
         // reserve the last char to ensure the server line has the last '\n'.
-        p = build_server_line(buf, (sizeof buf) - 1, s);
-        *p = '\n';
-        p++;
+        p = build_server_line(d->data + d->len, DUMP_BUFFER_SIZE - 1, s);
+        *p++ = '\n';
+        d->len = p - d->data;
+    }
+
+    return NGX_OK;
+}
+
+// writes the dump with one write, out of the event loop if it runs in a
+// thread, so it only records what failed.
+static void
+write_dump(dump_ctx *d) {
+    ngx_fd_t fd = -1;
+    u_char *p = d->data, *end = d->data + d->len;
+    ssize_t ret = -1;
+
+    d->failed = NULL;
+    d->err = 0;
+
+    fd = ngx_open_file(d->tmpfile, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+        NGX_FILE_DEFAULT_ACCESS);
+    if (fd < 0) {
+        d->failed = ngx_open_file_n;
+        goto failed;
+    }
 
-        ret = ngx_write_fd(fd, buf, p - buf);
+    // loops only on a short write.
+    while (p < end) {
+        ret = ngx_write_fd(fd, p, end - p);
         if (ret < 0) {
-            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
-                "upstream-serverlist: write dump file %s failed", tmpfile);
-            ngx_close_file(fd);
-            goto unlock;
+            d->failed = ngx_write_fd_n;
+            goto close;
+        }
+        p += ret;
+    }
+
+    if (d->fsync && fsync(fd) < 0) {
+        d->failed = "fsync()";
+        goto close;
+    }
+
+    if (ngx_close_file(fd) < 0) {
+        d->failed = ngx_close_file_n;
+        goto failed;
+    }
+
+    if (ngx_rename_file(d->tmpfile, d->file) < 0) {
+        d->failed = ngx_rename_file_n;
+        goto failed;
+    }
+
+    if (d->fsync) {
+        // makes the rename durable.
+        fd = ngx_open_file(d->dir, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+        if (fd < 0) {
+            d->failed = ngx_open_file_n;
+            goto failed;
+        }
+
+        if (fsync(fd) < 0) {
+            d->failed = "fsync()";
+            goto close;
         }
+
+        ngx_close_file(fd);
     }
 
+    return;
+
+close:
+    d->err = ngx_errno;
     ngx_close_file(fd);
-    ngx_memzero(buf, sizeof buf);
-    ngx_snprintf(buf, (sizeof buf) - 1, "%V/%V.conf", &mcf->conf_dump_dir,
-        &sl->name);
-    ret = ngx_rename_file(tmpfile, buf);
-    if (ret < 0) {
-        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
-            "upstream-serverlist: rename dump file %s failed", tmpfile);
-        goto unlock;
+    return;
+
+failed:
+    d->err = ngx_errno;
+}
+
+static void
+finish_dump(serverlist *sl) {
+    dump_ctx *d = sl->dump;
+
+    if (d->failed != NULL) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, d->err,
+            "upstream-serverlist: dump serverlist %V failed, %s of %s failed",
+            &sl->name, d->failed, d->tmpfile);
     }
 
-unlock:
+    d->busy = 0;
     ngx_shmtx_unlock(&sl->dump_file_lock);
+
+    if (d->again && !whole_world_exiting()) {
+        // servers changed while writing, dump the latest ones.
+        d->again = 0;
+        dump_serverlist(sl);
+    }
 }
 
-static ngx_int_t
-refresh_upstream(serverlist *sl, ngx_str_t *body, ngx_log_t *log) {
+#if (NGX_THREADS)
+
+static void
+dump_thread_handler(void *data, ngx_log_t *log) {
+    write_dump(data);
+}
+
+static void
+dump_event_handler(ngx_event_t *ev) {
+    finish_dump(ev->data);
+}
+
+#endif
+
+static void
+dump_serverlist(serverlist *sl) {
     main_conf *mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
         ngx_http_upstream_serverlist_module);
-    ngx_http_upstream_srv_conf_t *uscf = sl->upstream_conf;
-    ngx_conf_t cf = {0};
-    ngx_array_t *new_servers = NULL;    
+    dump_ctx *d = sl->dump;
 
-    // create new temp main_conf with a new pools, new service_conns and new serverlists, copy info from existing conf except for the pools, service_conns and serverlists
-    cf.pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+    if (mcf->conf_dump_dir.len <= 0) {
+        return;
+    }
 
-    ngx_http_conf_ctx_t *ctx = NULL;
-    ctx = ngx_pcalloc(cf.pool, sizeof(ngx_http_conf_ctx_t));
-    if (ctx == NULL) {
-        return -1;
+    if (d == NULL) {
+        d = ngx_pcalloc(mcf->conf_pool, sizeof *d);
+        if (d == NULL) {
+            return;
+        }
+        sl->dump = d;
     }
-    ctx = mcf->conf_ctx;
-    cf.ctx = ctx;
 
-    main_conf *tmp_mcf = create_main_conf(&cf);
+    if (d->busy) {
+        d->again = 1;
+        return;
+    } else if (!ngx_shmtx_trylock(&sl->dump_file_lock)) {
+        ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+            "upstream-serverlist: another worker process %d is dumping",
+            *sl->dump_file_lock.lock);
+        return;
+    }
 
-    //copy over previous count
-    tmp_mcf->conf_pool_count = mcf->conf_pool_count;
-    
+    if (build_dump(sl, d) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+            "upstream-serverlist: allocate dump of serverlist %V failed",
+            &sl->name);
+        ngx_shmtx_unlock(&sl->dump_file_lock);
+        return;
+    }
 
-    // create new server list
-    serverlist *new_sl = NULL;
-    new_sl = ngx_array_push(&tmp_mcf->serverlists);
-    if (new_sl == NULL) {
-        ngx_log_error(NGX_LOG_ERR, log, 0,
-            "upstream-serverlist: temp serverlists conf %V failed", uscf->host);
-        return -1;
-    }
-    ngx_memzero(new_sl, sizeof *new_sl);
-    new_sl->upstream_conf = uscf;
-    new_sl->last_modified = -1;
-    new_sl->name = uscf->host;
-
-    tmp_mcf->service_concurrency = mcf->service_concurrency;
-    tmp_mcf->service_url = mcf->service_url;
-    tmp_mcf->conf_dump_dir = mcf->conf_dump_dir;
-
-    //create new conns
-    service_conn *new_sc = NULL;
-    new_sc = ngx_array_push(&tmp_mcf->service_conns);
-    ngx_memzero(new_sc, sizeof *new_sc);
-    new_sc->send.start = ngx_pcalloc(tmp_mcf->conf_pool, MAX_HTTP_REQUEST_SIZE);
-    if (new_sc->send.start == NULL) {
-        ngx_log_error(NGX_LOG_ERR, log, 0,
-            "upstream-serverlist: new allocate send buffer failed");
-        return NGX_ERROR;
+    ngx_snprintf(d->tmpfile, sizeof d->tmpfile - 1, "%V/.%V.conf.tmp%Z",
+        &mcf->conf_dump_dir, &sl->name);
+    ngx_snprintf(d->file, sizeof d->file - 1, "%V/%V.conf%Z",
+        &mcf->conf_dump_dir, &sl->name);
+    ngx_snprintf(d->dir, sizeof d->dir - 1, "%V%Z", &mcf->conf_dump_dir);
+    d->fsync = mcf->dump_fsync;
+
+#if (NGX_THREADS)
+    // threads of pools are started in worker processes only.
+    if (mcf->dump_thread_pool != NULL && (ngx_process == NGX_PROCESS_WORKER
+            || ngx_process == NGX_PROCESS_SINGLE)) {
+        if (sl->dump_task == NULL) {
+            sl->dump_task = ngx_thread_task_alloc(mcf->conf_pool, 0);
+            if (sl->dump_task != NULL) {
+                sl->dump_task->ctx = d;
+                sl->dump_task->handler = dump_thread_handler;
+                sl->dump_task->event.handler = dump_event_handler;
+                sl->dump_task->event.data = sl;
+            }
+        }
+
+        if (sl->dump_task != NULL &&
+                ngx_thread_task_post(mcf->dump_thread_pool, sl->dump_task)
+                == NGX_OK) {
+            d->busy = 1;
+            return;
+        }
+
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+            "upstream-serverlist: post dump of serverlist %V to thread pool "
+            "failed, dump in place", &sl->name);
+    }
+#endif
+
+    write_dump(d);
+    finish_dump(sl);
+}
+
+// a snapshot is servers laid out flat, so it can be copied into shared memory
+// and read back by another worker without parsing or resolving. each server
+// is a snapshot_server, its name, then per address a snapshot_addr, the
+// sockaddr and the address name.
+typedef struct {
+    uint32_t                      weight;
+    uint32_t                      max_conns;
+    uint32_t                      max_fails;
+    uint32_t                      fail_timeout;
+    uint16_t                      name_len;
+    uint16_t                      naddrs;
+    uint8_t                       down;
+    uint8_t                       backup;
+    uint8_t                       interned; // name is an address literal.
+} snapshot_server;
+
+typedef struct {
+    uint16_t                      socklen;
+    uint16_t                      name_len;
+} snapshot_addr;
+
+static size_t
+snapshot_size(ngx_array_t *servers) {
+    ngx_http_upstream_server_t *s = servers->elts;
+    size_t size = 0;
+    ngx_uint_t i = 0, j = 0;
+
+    for (i = 0; i < servers->nelts; i++) {
+        size += sizeof(snapshot_server) + s[i].name.len;
+        for (j = 0; j < s[i].naddrs; j++) {
+            size += sizeof(snapshot_addr) + s[i].addrs[j].socklen
+                + s[i].addrs[j].name.len;
+        }
+    }
+
+    return size;
+}
+
+static u_char *
+write_snapshot(u_char *p, ngx_array_t *servers) {
+    main_conf *mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+        ngx_http_upstream_serverlist_module);
+    ngx_http_upstream_server_t *s = servers->elts;
+    interned_addrs *ia = NULL;
+    snapshot_server ss;
+    snapshot_addr sa;
+    ngx_uint_t i = 0, j = 0;
+
+    for (i = 0; i < servers->nelts; i++) {
+        ngx_memzero(&ss, sizeof ss);
+        ss.weight = s[i].weight;
+#if nginx_version >= 1011005
+        ss.max_conns = s[i].max_conns;
+#endif
+        ss.max_fails = s[i].max_fails;
+        ss.fail_timeout = s[i].fail_timeout;
+        ss.name_len = s[i].name.len;
+        ss.naddrs = s[i].naddrs;
+        ss.down = s[i].down;
+        ss.backup = s[i].backup;
+        ia = s[i].naddrs > 0 ? lookup_addrs(mcf, &s[i].name,
+            ngx_crc32_short(s[i].name.data, s[i].name.len)) : NULL;
+        ss.interned = ia != NULL && ia->addrs == s[i].addrs;
+        p = ngx_cpymem(p, &ss, sizeof ss);
+        p = ngx_cpymem(p, s[i].name.data, s[i].name.len);
+
+        for (j = 0; j < s[i].naddrs; j++) {
+            sa.socklen = s[i].addrs[j].socklen;
+            sa.name_len = s[i].addrs[j].name.len;
+            p = ngx_cpymem(p, &sa, sizeof sa);
+            p = ngx_cpymem(p, s[i].addrs[j].sockaddr, sa.socklen);
+            p = ngx_cpymem(p, s[i].addrs[j].name.data, sa.name_len);
+        }
+    }
+
+    return p;
+}
+
+// copies servers of a snapshot into pool, NULL if the snapshot is corrupted.
+// addresses of literals are shared with the ones interned in this worker.
+static ngx_array_t *
+read_snapshot(ngx_pool_t *pool, u_char *p, size_t len) {
+    main_conf *mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+        ngx_http_upstream_serverlist_module);
+    u_char *end = p + len;
+    ngx_array_t *servers = create_servers(pool, 2);
+    ngx_http_upstream_server_t *s = NULL;
+    interned_addrs *ia = NULL;
+    ngx_addr_t *addrs = NULL;
+    ngx_str_t name = {0};
+    uint32_t hash = 0;
+    snapshot_server ss;
+    snapshot_addr sa;
+    ngx_uint_t j = 0;
+
+    if (servers == NULL) {
+        return NULL;
+    }
+
+    while (p < end) {
+        if ((size_t)(end - p) < sizeof ss) {
+            return NULL;
+        }
+
+        ngx_memcpy(&ss, p, sizeof ss);
+        p += sizeof ss;
+        if ((size_t)(end - p) < ss.name_len) {
+            return NULL;
+        }
+
+        s = ngx_array_push(servers);
+        if (s == NULL) {
+            return NULL;
+        }
+
+        ngx_memzero(s, sizeof *s);
+        s->weight = ss.weight;
+#if nginx_version >= 1011005
+        s->max_conns = ss.max_conns;
+#endif
+        s->max_fails = ss.max_fails;
+        s->fail_timeout = ss.fail_timeout;
+        s->down = ss.down;
+        s->backup = ss.backup;
+
+        name.data = p;
+        name.len = ss.name_len;
+        p += ss.name_len;
+
+        ia = NULL;
+        if (ss.interned) {
+            hash = ngx_crc32_short(name.data, name.len);
+            ia = lookup_addrs(mcf, &name, hash);
+        }
+
+        // addresses to intern are only pointed to, they are copied once.
+        addrs = NULL;
+        if (ia == NULL) {
+            addrs = ngx_pcalloc(ss.interned ? mcf->intern_pool : pool,
+                ss.naddrs * sizeof(ngx_addr_t));
+            if (addrs == NULL) {
+                goto failed;
+            }
+        }
+
+        for (j = 0; j < ss.naddrs; j++) {
+            if ((size_t)(end - p) < sizeof sa) {
+                goto failed;
+            }
+
+            ngx_memcpy(&sa, p, sizeof sa);
+            p += sizeof sa;
+            if ((size_t)(end - p) < (size_t)sa.socklen + sa.name_len) {
+                goto failed;
+            }
+
+            if (addrs == NULL) {
+                p += sa.socklen + sa.name_len;
+                continue;
+            }
+
+            addrs[j].socklen = sa.socklen;
+            addrs[j].name.len = sa.name_len;
+
+            if (ss.interned) {
+                addrs[j].sockaddr = (struct sockaddr *)p;
+                addrs[j].name.data = p + sa.socklen;
+            } else {
+                addrs[j].sockaddr = ngx_palloc(pool, sa.socklen);
+                addrs[j].name.data = ngx_pnalloc(pool, sa.name_len);
+                if (addrs[j].sockaddr == NULL ||
+                        addrs[j].name.data == NULL) {
+                    goto failed;
+                }
+
+                ngx_memcpy(addrs[j].sockaddr, p, sa.socklen);
+                ngx_memcpy(addrs[j].name.data, p + sa.socklen, sa.name_len);
+            }
+
+            p += sa.socklen + sa.name_len;
+        }
+
+        if (ss.interned && ia == NULL) {
+            ia = intern_addrs(mcf, &name, hash, addrs, ss.naddrs);
+            ngx_reset_pool(mcf->intern_pool);
+            if (ia == NULL) {
+                return NULL;
+            }
+        }
+
+        if (ia != NULL) {
+            refer_addrs(ia, s);
+            continue;
+        }
+
+        s->name.len = name.len;
+        s->name.data = ngx_pstrdup(pool, &name);
+        if (s->name.data == NULL) {
+            return NULL;
+        }
+
+        s->addrs = addrs;
+        s->naddrs = ss.naddrs;
+    }
+
+    return servers;
+
+failed:
+    ngx_reset_pool(mcf->intern_pool);
+    return NULL;
+}
+
+// a snapshot file keeps all serverlists, so that they are loaded with one
+// mapping instead of a dump per serverlist. it is a snapshot_file_header, then
+// per serverlist a snapshot_list, its name, its etag and its servers as a
+// snapshot.
+typedef struct {
+    u_char                        magic[8];
+    uint64_t                      len; // of the whole file.
+    uint32_t                      nlists;
+} snapshot_file_header;
+
+typedef struct {
+    uint64_t                      body_hash; // 0 with body_len if none.
+    uint64_t                      body_len;
+    uint64_t                      servers_len;
+    int64_t                       last_modified;
+    int64_t                       index;
+    uint16_t                      name_len;
+    uint16_t                      etag_len;
+} snapshot_list;
+
+// serializes serverlists whose servers were fetched into the buffer of d.
+static ngx_int_t
+build_snapshot_file(main_conf *mcf, dump_ctx *d) {
+    snapshot_file_header header;
+    snapshot_list sn;
+    serverlist *sl = NULL;
+    size_t size = sizeof header;
+    u_char *p = NULL;
+    ngx_uint_t i = 0;
+
+    for (i = 0; i < mcf->serverlists.nelts; i++) {
+        sl = (serverlist *)mcf->serverlists.elts + i;
+        if (sl->pool != NULL) {
+            size += sizeof sn + sl->name.len + sl->etag.len
+                + snapshot_size(sl->upstream_conf->servers);
+        }
+    }
+
+    d->len = 0;
+    if (grow_dump(d, size) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&header, sizeof header);
+    p = d->data + sizeof header;
+
+    for (i = 0; i < mcf->serverlists.nelts; i++) {
+        sl = (serverlist *)mcf->serverlists.elts + i;
+        if (sl->pool == NULL) {
+            // never fetched, the upstream has servers of nginx.conf.
+            continue;
+        }
+
+        ngx_memzero(&sn, sizeof sn);
+        if (sl->body_hash_valid) {
+            sn.body_hash = sl->body_hash;
+            sn.body_len = sl->body_len;
+        }
+        sn.servers_len = snapshot_size(sl->upstream_conf->servers);
+        sn.last_modified = sl->last_modified;
+        sn.index = sl->index;
+        sn.name_len = sl->name.len;
+        sn.etag_len = sl->etag.len;
+
+        p = ngx_cpymem(p, &sn, sizeof sn);
+        p = ngx_cpymem(p, sl->name.data, sl->name.len);
+        p = ngx_cpymem(p, sl->etag.data, sl->etag.len);
+        p = write_snapshot(p, sl->upstream_conf->servers);
+        header.nlists++;
+    }
+
+    ngx_memcpy(header.magic, SNAPSHOT_FILE_MAGIC, sizeof header.magic);
+    header.len = p - d->data;
+    ngx_memcpy(d->data, &header, sizeof header);
+    d->len = p - d->data;
+    return NGX_OK;
+}
+
+// writes the snapshot file a while after serverlists changed, so that changes
+// of a round take one write.
+static void
+schedule_snapshot() {
+    main_conf *mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+        ngx_http_upstream_serverlist_module);
+
+    if (mcf->snapshot_file.len <= 0) {
+        return;
+    }
+
+    if (mcf->snapshot != NULL && mcf->snapshot->busy) {
+        mcf->snapshot->again = 1;
+    } else if (!mcf->snapshot_timer.timer_set) {
+        ngx_add_timer(&mcf->snapshot_timer, refresh_interval_ms);
+    }
+}
+
+static void
+finish_snapshot(main_conf *mcf) {
+    dump_ctx *d = mcf->snapshot;
+
+    if (d->failed != NULL) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, d->err,
+            "upstream-serverlist: write snapshot failed, %s of %s failed",
+            d->failed, d->tmpfile);
+    }
+
+    d->busy = 0;
+    ngx_shmtx_unlock(&mcf->snapshot_lock);
+
+    if (d->again) {
+        d->again = 0;
+        schedule_snapshot();
+    }
+}
+
+#if (NGX_THREADS)
+
+static void
+snapshot_event_handler(ngx_event_t *ev) {
+    finish_snapshot(ev->data);
+}
+
+#endif
+
+static void
+snapshot_timer_handler(ngx_event_t *ev) {
+    main_conf *mcf = ev->data;
+    dump_ctx *d = mcf->snapshot;
+    u_char *slash = NULL;
+
+    if (d == NULL) {
+        d = ngx_pcalloc(mcf->conf_pool, sizeof *d);
+        if (d == NULL) {
+            return;
+        }
+
+        ngx_snprintf(d->tmpfile, sizeof d->tmpfile - 1, "%V.tmp%Z",
+            &mcf->snapshot_file);
+        ngx_snprintf(d->file, sizeof d->file - 1, "%V%Z",
+            &mcf->snapshot_file);
+
+        // the full path always has a slash.
+        slash = d->file + mcf->snapshot_file.len;
+        while (slash > d->file && *slash != '/') {
+            slash--;
+        }
+        ngx_memcpy(d->dir, d->file, slash > d->file ? slash - d->file : 1);
+        mcf->snapshot = d;
+    }
+
+    if (!ngx_shmtx_trylock(&mcf->snapshot_lock)) {
+        // another worker is writing what it fetched, this one may have
+        // changes it has not.
+        ngx_add_timer(ev, refresh_interval_ms);
+        return;
+    }
+
+    if (build_snapshot_file(mcf, d) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+            "upstream-serverlist: allocate snapshot failed");
+        ngx_shmtx_unlock(&mcf->snapshot_lock);
+        return;
+    }
+
+    d->fsync = mcf->dump_fsync;
+
+#if (NGX_THREADS)
+    if (mcf->dump_thread_pool != NULL && (ngx_process == NGX_PROCESS_WORKER
+            || ngx_process == NGX_PROCESS_SINGLE)) {
+        if (mcf->snapshot_task == NULL) {
+            mcf->snapshot_task = ngx_thread_task_alloc(mcf->conf_pool, 0);
+            if (mcf->snapshot_task != NULL) {
+                mcf->snapshot_task->ctx = d;
+                mcf->snapshot_task->handler = dump_thread_handler;
+                mcf->snapshot_task->event.handler = snapshot_event_handler;
+                mcf->snapshot_task->event.data = mcf;
+            }
+        }
+
+        if (mcf->snapshot_task != NULL &&
+                ngx_thread_task_post(mcf->dump_thread_pool,
+                    mcf->snapshot_task) == NGX_OK) {
+            d->busy = 1;
+            return;
+        }
+
+        ngx_log_error(NGX_LOG_WARN, ev->log, 0,
+            "upstream-serverlist: post snapshot to thread pool failed, write "
+            "in place");
+    }
+#endif
+
+    write_dump(d);
+    finish_snapshot(mcf);
+}
+
+// peers are built in servers order, non-backup servers into peers and backup
+// servers into peers->next, one peer per address. returns the first peer of
+// each server, indexed like servers.
+static ngx_http_upstream_rr_peer_t **
+map_server_peers(ngx_pool_t *pool, const ngx_array_t *servers,
+    ngx_http_upstream_rr_peers_t *peers) {
+    ngx_http_upstream_rr_peer_t **map = NULL, *primary = NULL, *backup = NULL;
+    ngx_http_upstream_rr_peer_t **cursor = NULL;
+    ngx_http_upstream_server_t *s = NULL;
+    ngx_uint_t i = 0, j = 0;
+
+    map = ngx_pcalloc(pool, (servers->nelts + 1) * sizeof *map);
+    if (map == NULL) {
+        return NULL;
+    }
+
+    primary = peers->peer;
+    backup = peers->next ? peers->next->peer : NULL;
+
+    for (i = 0; i < servers->nelts; i++) {
+        s = (ngx_http_upstream_server_t *)servers->elts + i;
+        cursor = s->backup ? &backup : &primary;
+        map[i] = *cursor;
+
+        for (j = 0; j < s->naddrs; j++) {
+            if (*cursor == NULL) {
+                // peers are not built from these servers.
+                return NULL;
+            }
+            *cursor = (*cursor)->next;
+        }
+    }
+
+    return map;
+}
+
+#if nginx_version >= 1011005
+
+// peers of a list that are not down, what ngx_http_upstream_tries() bounds
+// next upstream tries with, as ngx_http_upstream_init_round_robin() counts.
+static void
+count_peer_tries(ngx_http_upstream_rr_peers_t *list) {
+    ngx_http_upstream_rr_peer_t *peer = NULL;
+
+    list->tries = 0;
+    for (peer = list->peer; peer != NULL; peer = peer->next) {
+        if (!peer->down) {
+            list->tries++;
+        }
+    }
+}
+
+#endif
+
+static void
+patch_peers(serverlist *sl, server_changes *changes,
+    ngx_http_upstream_rr_peer_t **map) {
+    ngx_http_upstream_srv_conf_t *uscf = sl->upstream_conf;
+    ngx_http_upstream_rr_peers_t *peers = uscf->peer.data, *list = NULL;
+    ngx_http_upstream_rr_peer_t *peer = NULL;
+    ngx_http_upstream_server_t *old = NULL, *new = NULL;
+    server_pair *pair = NULL;
+    ngx_uint_t i = 0, j = 0;
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    for (i = 0; i < changes->modified.nelts; i++) {
+        pair = (server_pair *)changes->modified.elts + i;
+        old = pair->old;
+        new = pair->new;
+        list = old->backup ? peers->next : peers;
+        peer = map[old - (ngx_http_upstream_server_t *)uscf->servers->elts];
+
+        for (j = 0; j < new->naddrs; j++, peer = peer->next) {
+            if (peer->weight != (ngx_int_t)new->weight) {
+                list->total_weight = list->total_weight - peer->weight
+                    + new->weight;
+                peer->weight = new->weight;
+                peer->effective_weight = new->weight;
+            }
+
+#if nginx_version >= 1011005
+            peer->max_conns = new->max_conns;
+#endif
+            peer->max_fails = new->max_fails;
+            peer->fail_timeout = new->fail_timeout;
+            peer->down = new->down;
+        }
+
+        list->weighted = (list->total_weight != list->number);
+
+        old->weight = new->weight;
+#if nginx_version >= 1011005
+        old->max_conns = new->max_conns;
+#endif
+        old->max_fails = new->max_fails;
+        old->fail_timeout = new->fail_timeout;
+        old->down = new->down;
+    }
+
+#if nginx_version >= 1011005
+    count_peer_tries(peers);
+    if (peers->next != NULL) {
+        count_peer_tries(peers->next);
+    }
+#endif
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+}
+
+static ngx_uint_t
+same_peer_address(ngx_http_upstream_rr_peer_t *a,
+    ngx_http_upstream_rr_peer_t *b) {
+    return a->socklen == b->socklen &&
+        ngx_memcmp(a->sockaddr, b->sockaddr, a->socklen) == 0;
+}
+
+// carries state of the nfrom peers of a server to the nto peers it is built
+// into now, matched by address. conns are handed over too, so that max_conns
+// and least_conn count requests still using the old peers.
+static void
+inherit_peer_state(ngx_http_upstream_rr_peer_t *from, ngx_uint_t nfrom,
+    ngx_http_upstream_rr_peer_t *to, ngx_uint_t nto, peer_handoff **handoffs,
+    ngx_slab_pool_t *shpool, ngx_log_t *log) {
+    ngx_http_upstream_rr_peer_t *p = NULL, *same = from;
+    peer_handoff *h = NULL;
+    ngx_uint_t i = 0, j = 0;
+
+    for (i = 0; i < nto; i++, to = to->next) {
+        // addresses of a server keep their order, unless it was resolved
+        // again.
+        p = same;
+        if (i >= nfrom || !same_peer_address(p, to)) {
+            for (j = 0, p = from; j < nfrom; j++, p = p->next) {
+                if (same_peer_address(p, to)) {
+                    break;
+                }
+            }
+
+            if (j >= nfrom) {
+                p = NULL;
+            }
+        }
+
+        if (i + 1 < nfrom) {
+            same = same->next;
+        }
+
+        if (p == NULL) {
+            continue;
+        }
+
+        to->current_weight = p->current_weight;
+        if (p->weight == to->weight) {
+            to->effective_weight = p->effective_weight;
+        }
+        to->fails = p->fails;
+        to->accessed = p->accessed;
+        to->checked = p->checked;
+
+        if (p->conns <= 0) {
+            continue;
+        }
+
+        // zone peers are settled by any worker, so are their handoffs.
+        h = shpool != NULL ? ngx_slab_alloc(shpool, sizeof *h)
+            : ngx_alloc(sizeof *h, log);
+        if (h == NULL) {
+            // the new peer just starts without them.
+            continue;
+        }
+
+        h->from = p;
+        h->to = to;
+        h->conns = p->conns;
+        h->next = *handoffs;
+        *handoffs = h;
+        to->conns += p->conns;
+    }
+}
+
+// carries state of the old peers of servers unchanged or modified by changes
+// to their new peers, server by server. handoffs are allocated in shpool, if
+// the peers are in a zone.
+static void
+inherit_servers_state(serverlist *sl, server_changes *changes,
+    ngx_array_t *old_servers, ngx_http_upstream_rr_peers_t *old_peers,
+    ngx_array_t *new_servers, ngx_http_upstream_rr_peers_t *new_peers,
+    peer_handoff **handoffs, ngx_slab_pool_t *shpool, ngx_log_t *log) {
+    ngx_http_upstream_rr_peer_t **old_map = NULL, **new_map = NULL;
+    ngx_http_upstream_server_t *old_elts = old_servers->elts;
+    ngx_http_upstream_server_t *new_elts = new_servers->elts;
+    ngx_array_t *pairs[2] = {&changes->unchanged, &changes->modified};
+    server_pair *pair = NULL;
+    ngx_uint_t i = 0, k = 0;
+
+    old_map = map_server_peers(sl->new_pool, old_servers, old_peers);
+    new_map = map_server_peers(sl->new_pool, new_servers, new_peers);
+    if (old_map == NULL || new_map == NULL) {
+        return;
+    }
+
+    for (k = 0; k < 2; k++) {
+        for (i = 0; i < pairs[k]->nelts; i++) {
+            pair = (server_pair *)pairs[k]->elts + i;
+            inherit_peer_state(old_map[pair->old - old_elts],
+                pair->old->naddrs, new_map[pair->new - new_elts],
+                pair->new->naddrs, handoffs, shpool, log);
+        }
+    }
+}
+
+// forwards to their successors the conns released on retired peers since the
+// last call, and drops handoffs of retired peers no request holds any more.
+// zone peers must be locked. a successor may be retired too and hand over in
+// turn, passes are repeated until releases went down the whole chain, so that
+// every handoff left has a retired peer still holding conns.
+static void
+settle_handoffs(peer_handoff **handoffs, ngx_slab_pool_t *shpool) {
+    peer_handoff **hp = NULL, *h = NULL;
+    ngx_uint_t changed = 1;
+
+    while (changed) {
+        changed = 0;
+
+        for (hp = handoffs; *hp != NULL; ) {
+            h = *hp;
+
+            // per-worker peers may even be taken again by requests retrying
+            // within the retired generation.
+            if (h->conns != h->from->conns) {
+                h->to->conns = h->to->conns - h->conns + h->from->conns;
+                h->conns = h->from->conns;
+                changed = 1;
+            }
+
+            if (h->conns > 0) {
+                hp = &h->next;
+                continue;
+            }
+
+            *hp = h->next;
+            if (shpool != NULL) {
+                ngx_slab_free(shpool, h);
+            } else {
+                ngx_free(h);
+            }
+        }
+    }
+}
+
+static ngx_uint_t
+handed_off(peer_handoff *h, ngx_http_upstream_rr_peer_t *peer) {
+    for (; h != NULL; h = h->next) {
+        if (h->from == peer) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// builds round robin peers of servers in sl->new_pool, returns NULL if
+// failed.
+static ngx_http_upstream_rr_peers_t *
+build_peers(serverlist *sl, ngx_array_t *servers, ngx_log_t *log) {
+    ngx_http_upstream_srv_conf_t *uscf = sl->upstream_conf, us;
+    ngx_conf_t cf;
+
+    // build peers on a copy, so that the balancer's own peer.init set on
+    // uscf by ip_hash, least_conn etc. survives.
+    us = *uscf;
+    us.servers = servers;
+    us.peer.data = NULL;
+
+    ngx_memzero(&cf, sizeof cf);
+    cf.name = "serverlist_init_upstream";
+    cf.cycle = (ngx_cycle_t *) ngx_cycle;
+    cf.pool = sl->new_pool;
+    cf.module_type = NGX_HTTP_MODULE;
+    cf.cmd_type = NGX_HTTP_MAIN_CONF;
+    cf.log = log;
+    cf.ctx = ((main_conf *)ngx_http_cycle_get_module_main_conf(ngx_cycle,
+        ngx_http_upstream_serverlist_module))->conf_ctx;
+
+    // see: https://github.com/GUI/nginx-upstream-dynamic-servers/pull/33/files
+    // only round robin peers are rebuilt, calling uscf->peer.init_upstream
+    // would also reinitialize keepalive's cache queue, and cached connections
+    // closed later would crash.
+    if (ngx_http_upstream_init_round_robin(&cf, &us) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+            "upstream-serverlist: refresh upstream %V failed, keep old peers",
+            &uscf->host);
+        return NULL;
+    }
+
+    return us.peer.data;
+}
+
+static ngx_int_t
+rebuild_peers(serverlist *sl, ngx_array_t *new_servers,
+    server_changes *changes, ngx_log_t *log) {
+    ngx_http_upstream_srv_conf_t *uscf = sl->upstream_conf;
+    ngx_http_upstream_rr_peers_t *peers = NULL;
+    retired_peers *retired = NULL;
+
+    // peers built at configuration are never freed, and need no record.
+    if (sl->peers_pool != NULL) {
+        retired = ngx_palloc(sl->peers_pool, sizeof *retired);
+        if (retired == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    peers = build_peers(sl, new_servers, log);
+    if (peers == NULL) {
+        return NGX_ERROR;
+    }
+
+    inherit_servers_state(sl, changes, uscf->servers, uscf->peer.data,
+        new_servers, peers, &sl->handoffs, NULL, log);
+
+    if (retired != NULL) {
+        retired->peers = uscf->peer.data;
+        retired->pool = sl->peers_pool;
+        retired->next = sl->retired;
+        sl->retired = retired;
+    }
+
+    uscf->servers = new_servers;
+    uscf->peer.data = peers;
+    sl->peers_pool = sl->new_pool;
+
+#if (NGX_HTTP_UPSTREAM_CHECK)
+    if (ngx_http_upstream_check_update_upstream_peers(uscf, sl->new_pool) !=
+            NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+            "upstream-serverlist: update check module upstream %V failed",
+            &uscf->host);
+    }
+#endif
+
+    return NGX_OK;
+}
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+// words of the tried bitmap a request allocates for n peers.
+static ngx_uint_t
+tried_words(ngx_uint_t n) {
+    if (n <= 8 * sizeof(uintptr_t)) {
+        return 1;
+    }
+
+    return (n + (8 * sizeof(uintptr_t) - 1)) / (8 * sizeof(uintptr_t));
+}
+
+// returns 1 if zone peers are what ngx_http_upstream_init_round_robin()
+// would build from servers.
+static ngx_int_t
+same_zone_peers(const ngx_array_t *servers,
+    ngx_http_upstream_rr_peers_t *peers) {
+    ngx_http_upstream_rr_peer_t *primary = peers->peer, *backup = NULL;
+    ngx_http_upstream_rr_peer_t **cursor = NULL, *peer = NULL;
+    ngx_http_upstream_server_t *s = NULL;
+    ngx_uint_t i = 0, j = 0;
+
+    backup = peers->next ? peers->next->peer : NULL;
+
+    for (i = 0; i < servers->nelts; i++) {
+        s = (ngx_http_upstream_server_t *)servers->elts + i;
+        cursor = s->backup ? &backup : &primary;
+
+        for (j = 0; j < s->naddrs; j++) {
+            peer = *cursor;
+            if (peer == NULL || peer->socklen != s->addrs[j].socklen ||
+                ngx_memcmp(peer->sockaddr, s->addrs[j].sockaddr,
+                    peer->socklen) != 0 ||
+                peer->weight != (ngx_int_t)s->weight ||
+#if nginx_version >= 1011005
+                peer->max_conns != s->max_conns ||
+#endif
+                peer->max_fails != s->max_fails ||
+                peer->fail_timeout != s->fail_timeout ||
+                peer->down != s->down) {
+                return 0;
+            }
+            *cursor = peer->next;
+        }
+    }
+
+    return primary == NULL && backup == NULL;
+}
+
+static void
+free_zone_peers(ngx_slab_pool_t *shpool, ngx_http_upstream_rr_peer_t *peer) {
+    ngx_http_upstream_rr_peer_t *next = NULL;
+
+    for (; peer != NULL; peer = next) {
+        next = peer->next;
+        ngx_slab_free(shpool, peer);
+    }
+}
+
+// copies a peer list into the zone. a peer and its strings take one chunk, so
+// that one ngx_slab_free() releases them.
+static ngx_int_t
+copy_zone_peers(ngx_slab_pool_t *shpool, ngx_http_upstream_rr_peer_t *from,
+    ngx_http_upstream_rr_peer_t **to) {
+    ngx_http_upstream_rr_peer_t *peer = NULL, **next = to;
+    u_char *p = NULL;
+
+    *to = NULL;
+
+    for (; from != NULL; from = from->next) {
+        peer = ngx_slab_alloc(shpool, sizeof *peer + from->socklen
+            + from->name.len + from->server.len);
+        if (peer == NULL) {
+            free_zone_peers(shpool, *to);
+            *to = NULL;
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(peer, from, sizeof *peer);
+        p = (u_char *)(peer + 1);
+        peer->sockaddr = (struct sockaddr *)p;
+        p = ngx_cpymem(p, from->sockaddr, from->socklen);
+        peer->name.data = p;
+        p = ngx_cpymem(p, from->name.data, from->name.len);
+        peer->server.data = p;
+        ngx_memcpy(p, from->server.data, from->server.len);
+        peer->lock = 0;
+        peer->next = NULL;
+
+        *next = peer;
+        next = &peer->next;
+    }
+
+    return NGX_OK;
+}
+
+// frees retired zone peers no request holds any more, under the lock of the
+// zone peers, after their handoffs are settled.
+static void
+free_idle_zone_peers(zone_peers *zone, ngx_slab_pool_t *shpool) {
+    ngx_http_upstream_rr_peer_t **pp = &zone->retired, *peer = NULL;
+
+    while (*pp != NULL) {
+        peer = *pp;
+        if (peer->conns > 0 || handed_off(zone->handoffs, peer)) {
+            pp = &peer->next;
+            continue;
+        }
+
+        *pp = peer->next;
+        ngx_slab_free(shpool, peer);
+    }
+}
+
+static void
+retire_zone_peers(zone_peers *zone, ngx_http_upstream_rr_peer_t *peer) {
+    ngx_http_upstream_rr_peer_t *next = NULL;
+
+    for (; peer != NULL; peer = next) {
+        next = peer->next;
+        peer->next = zone->retired;
+        zone->retired = peer;
+    }
+}
+
+// writes peers of new_servers into the upstream zone, under its lock, unless
+// some other process already did. returns NGX_DECLINED if they can not replace
+// the zone peers in place.
+static ngx_int_t
+rebuild_zone_peers(serverlist *sl, ngx_array_t *new_servers,
+    server_changes *changes, ngx_log_t *log) {
+    ngx_http_upstream_srv_conf_t *uscf = sl->upstream_conf;
+    ngx_http_upstream_rr_peers_t *peers = uscf->peer.data, *backup = NULL;
+    ngx_http_upstream_rr_peers_t *built = NULL, written, written_backup;
+    ngx_http_upstream_rr_peer_t *primary_peer = NULL, *backup_peer = NULL;
+    ngx_slab_pool_t *shpool = peers->shpool;
+    ngx_uint_t words = 0;
+    ngx_int_t ret = NGX_OK;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+    ret = same_zone_peers(new_servers, peers);
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    if (ret) {
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, log, 0,
+            "upstream-serverlist: zone peers of upstream %V already written",
+            &uscf->host);
+        goto done;
+    }
+
+    built = build_peers(sl, new_servers, log);
+    if (built == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (copy_zone_peers(shpool, built->peer, &primary_peer) != NGX_OK ||
+        copy_zone_peers(shpool, built->next ? built->next->peer : NULL,
+            &backup_peer) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+            "upstream-serverlist: zone of upstream %V is full, keep old peers",
+            &uscf->host);
+        free_zone_peers(shpool, primary_peer);
+        return NGX_ERROR;
+    }
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+    backup = peers->next;
+    if (backup != NULL) {
+        ngx_http_upstream_rr_peers_wlock(backup);
+    }
+
+    // requests size their tried bitmap by the numbers of peers when they
+    // start, and index it while walking peers, so new peers must fit in it.
+    words = tried_words(ngx_max(peers->number, backup ? backup->number : 0));
+
+    if (same_zone_peers(new_servers, peers)) {
+        ret = NGX_DONE;
+    } else if (tried_words(built->number) > words || (built->next != NULL &&
+            (backup == NULL || tried_words(built->next->number) > words))) {
+        ret = NGX_DECLINED;
+    } else {
+        // peers retired by earlier writes are freed once idle, requests may
+        // still hold the ones retired by this write.
+        settle_handoffs(&sl->zone->handoffs, shpool);
+        free_idle_zone_peers(sl->zone, shpool);
+
+        // servers of this worker map onto the zone peers only if it wrote
+        // them, or applied what was written.
+        if (same_zone_peers(uscf->servers, peers)) {
+            ngx_memzero(&written, sizeof written);
+            ngx_memzero(&written_backup, sizeof written_backup);
+            written.peer = primary_peer;
+            written_backup.peer = backup_peer;
+            written.next = backup_peer != NULL ? &written_backup : NULL;
+
+            inherit_servers_state(sl, changes, uscf->servers, peers,
+                new_servers, &written, &sl->zone->handoffs, shpool, log);
+        }
+
+        retire_zone_peers(sl->zone, peers->peer);
+
+        peers->peer = primary_peer;
+        peers->number = built->number;
+        peers->total_weight = built->total_weight;
+        peers->weighted = built->weighted;
+        peers->single = built->single;
+#if nginx_version >= 1011005
+        // ngx_http_upstream_tries() bounds next upstream tries with it.
+        peers->tries = built->tries;
+#endif
+
+        if (backup != NULL) {
+            retire_zone_peers(sl->zone, backup->peer);
+
+            // kept even if empty, requests may have switched to it.
+            backup->peer = backup_peer;
+            backup->number = built->next ? built->next->number : 0;
+            backup->total_weight = built->next ? built->next->total_weight : 0;
+            backup->weighted = built->next ? built->next->weighted : 0;
+#if nginx_version >= 1011005
+            backup->tries = built->next ? built->next->tries : 0;
+#endif
+        }
+    }
+
+    if (backup != NULL) {
+        ngx_http_upstream_rr_peers_unlock(backup);
+    }
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    if (ret != NGX_OK) {
+        free_zone_peers(shpool, primary_peer);
+        free_zone_peers(shpool, backup_peer);
+    }
+
+    if (ret == NGX_DECLINED) {
+        return NGX_DECLINED;
+    }
+
+done:
+    uscf->servers = new_servers;
+
+#if (NGX_HTTP_UPSTREAM_CHECK)
+    if (ngx_http_upstream_check_update_upstream_peers(uscf, sl->new_pool) !=
+            NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+            "upstream-serverlist: update check module upstream %V failed",
+            &uscf->host);
+    }
+#endif
+
+    return NGX_OK;
+}
+
+#endif
+
+static void *
+slots_calloc(ngx_slab_pool_t *shpool, ngx_pool_t *pool, size_t size) {
+    return shpool != NULL ? ngx_slab_calloc(shpool, size)
+        : ngx_pcalloc(pool, size);
+}
+
+static uint32_t
+sockaddr_hash(struct sockaddr *sockaddr, socklen_t socklen) {
+    return ngx_crc32_short((u_char *)sockaddr, socklen);
+}
+
+static void
+index_slot(peer_slots *ps, ngx_uint_t i) {
+    ngx_uint_t j = 0;
+
+    for (j = ps->slots[i].hash & ps->mask; ps->index[j];
+            j = (j + 1) & ps->mask) {
+        /* void */
+    }
+    ps->index[j] = i + 1;
+}
+
+// removes entry j of the index, and shifts back entries after it, so that no
+// lookup stops early at the hole.
+static void
+unindex_slot(peer_slots *ps, ngx_uint_t j) {
+    ngx_uint_t k = j, home = 0;
+
+    for ( ;; ) {
+        k = (k + 1) & ps->mask;
+        if (ps->index[k] == 0) {
+            break;
+        }
+
+        home = ps->slots[ps->index[k] - 1].hash & ps->mask;
+        if ((j < k && (home <= j || home > k)) ||
+            (j > k && home <= j && home > k)) {
+            ps->index[j] = ps->index[k];
+            j = k;
+        }
+    }
+
+    ps->index[j] = 0;
+}
+
+// returns the position of the active slot of addr in the index, or -1.
+static ngx_int_t
+find_slot(peer_slots *ps, ngx_addr_t *addr) {
+    peer_slot *slot = NULL;
+    uint32_t hash = sockaddr_hash(addr->sockaddr, addr->socklen);
+    ngx_uint_t j = 0;
+
+    for (j = hash & ps->mask; ps->index[j]; j = (j + 1) & ps->mask) {
+        slot = &ps->slots[ps->index[j] - 1];
+        if (slot->hash == hash && slot->peer.socklen == addr->socklen &&
+            ngx_memcmp(slot->peer.sockaddr, addr->sockaddr,
+                addr->socklen) == 0) {
+            return j;
+        }
+    }
+
+    return -1;
+}
+
+static void
+set_slot_attrs(peer_slots *ps, peer_slot *slot,
+    const ngx_http_upstream_server_t *s) {
+    ngx_http_upstream_rr_peer_t *peer = &slot->peer;
+
+    if (peer->weight != (ngx_int_t)s->weight) {
+        ps->peers->total_weight = ps->peers->total_weight - peer->weight
+            + s->weight;
+        peer->weight = s->weight;
+        peer->effective_weight = s->weight;
+    }
+
+#if nginx_version >= 1011005
+    peer->max_conns = s->max_conns;
+#endif
+    peer->max_fails = s->max_fails;
+    peer->fail_timeout = s->fail_timeout;
+    peer->down = s->down;
+}
+
+// activates a free slot for addr of server s, or updates the one it has.
+// returns NGX_DECLINED if no slot is free.
+static ngx_int_t
+set_slot(peer_slots *ps, const ngx_http_upstream_server_t *s,
+    ngx_addr_t *addr) {
+    ngx_http_upstream_rr_peer_t *peer = NULL;
+    peer_slot *slot = NULL;
+    ngx_int_t j = find_slot(ps, addr);
+    ngx_uint_t i = 0;
+
+    if (j >= 0) {
+        slot = &ps->slots[ps->index[j] - 1];
+        set_slot_attrs(ps, slot, s);
+        slot->stamp = ps->stamp;
+        return NGX_OK;
+    }
+
+    if (ps->nfree <= 0) {
+        return NGX_DECLINED;
+    }
+
+    i = ps->free[--ps->nfree];
+    slot = &ps->slots[i];
+    peer = &slot->peer;
+
+    ngx_memcpy(&slot->sockaddr, addr->sockaddr, addr->socklen);
+    peer->sockaddr = &slot->sockaddr.sockaddr;
+    peer->socklen = addr->socklen;
+    peer->name.len = ngx_min(addr->name.len, sizeof slot->name);
+    peer->name.data = slot->name;
+    ngx_memcpy(slot->name, addr->name.data, peer->name.len);
+
+    if (s->name.len <= sizeof slot->server) {
+        peer->server.len = s->name.len;
+        peer->server.data = slot->server;
+        ngx_memcpy(slot->server, s->name.data, s->name.len);
+    } else {
+        peer->server = peer->name;
+    }
+
+    // conns is kept, requests that used the slot before release there.
+    peer->current_weight = 0;
+    peer->fails = 0;
+    peer->accessed = 0;
+    peer->checked = 0;
+    set_slot_attrs(ps, slot, s);
+
+    slot->hash = sockaddr_hash(addr->sockaddr, addr->socklen);
+    slot->active = 1;
+    slot->stamp = ps->stamp;
+    index_slot(ps, i);
+    return NGX_OK;
+}
+
+// deactivates the slot at position j of the index.
+static void
+clear_slot(peer_slots *ps, ngx_int_t j) {
+    ngx_uint_t i = ps->index[j] - 1;
+    ngx_http_upstream_rr_peer_t *peer = &ps->slots[i].peer;
+
+    unindex_slot(ps, j);
+
+    ps->peers->total_weight -= peer->weight;
+    peer->weight = 0;
+    peer->effective_weight = 0;
+    peer->current_weight = 0;
+    peer->down = 1;
+
+    ps->slots[i].active = 0;
+    ps->free[ps->nfree++] = i;
+}
+
+static void
+clear_server_slots(peer_slots *ps, const ngx_http_upstream_server_t *s) {
+    ngx_int_t j = 0;
+    ngx_uint_t k = 0;
+
+    for (k = 0; k < s->naddrs; k++) {
+        j = find_slot(ps, &s->addrs[k]);
+        if (j >= 0) {
+            clear_slot(ps, j);
+        }
+    }
+}
+
+static void
+set_server_slots(peer_slots *ps, const ngx_http_upstream_server_t *s) {
+    ngx_uint_t k = 0;
+
+    for (k = 0; k < s->naddrs; k++) {
+        // left to reconcile_slots() if no slot is free.
+        (void)set_slot(ps, s, &s->addrs[k]);
+    }
+}
+
+// makes slots of a peer list exactly the addresses of servers, used when
+// they were changed by some other process from what this one knew.
+static void
+reconcile_slots(peer_slots *ps, const ngx_array_t *servers,
+    ngx_uint_t backup) {
+    ngx_http_upstream_server_t *s = NULL;
+    ngx_uint_t i = 0, k = 0;
+    ngx_int_t j = 0;
+
+    ps->stamp++;
+
+    for (i = 0; i < servers->nelts; i++) {
+        s = (ngx_http_upstream_server_t *)servers->elts + i;
+        if (s->backup != backup) {
+            continue;
+        }
+
+        for (k = 0; k < s->naddrs; k++) {
+            j = find_slot(ps, &s->addrs[k]);
+            if (j >= 0) {
+                ps->slots[ps->index[j] - 1].stamp = ps->stamp;
+            }
+        }
+    }
+
+    // clear_slot() shifts later entries back to j, so j is checked again.
+    for (j = 0; j <= (ngx_int_t)ps->mask; ) {
+        if (ps->index[j] && ps->slots[ps->index[j] - 1].stamp != ps->stamp) {
+            clear_slot(ps, j);
+            continue;
+        }
+        j++;
+    }
+
+    for (i = 0; i < servers->nelts; i++) {
+        s = (ngx_http_upstream_server_t *)servers->elts + i;
+        if (s->backup == backup) {
+            set_server_slots(ps, s);
+        }
+    }
+}
+
+// applies changes of servers by flipping reserved peer slots, nothing is
+// allocated and peer lists never grow.
+static ngx_int_t
+flip_peer_slots(serverlist *sl, ngx_array_t *new_servers,
+    server_changes *changes, ngx_log_t *log) {
+    ngx_http_upstream_srv_conf_t *uscf = sl->upstream_conf;
+    ngx_http_upstream_server_t *s = NULL, **ps = NULL;
+    peer_slots *slots = sl->slots;
+    server_pair *pair = NULL;
+    ngx_uint_t need[2] = {0, 0}, i = 0, k = 0;
+
+    for (i = 0; i < new_servers->nelts; i++) {
+        s = (ngx_http_upstream_server_t *)new_servers->elts + i;
+        need[s->backup ? 1 : 0] += s->naddrs;
+    }
+
+    if (need[0] > sl->max_servers || need[1] > sl->max_servers) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+            "upstream-serverlist: serverlist %V has more than max_servers=%ui "
+            "addresses, keep old peers", &sl->name, sl->max_servers);
+        return NGX_ERROR;
+    }
+
+    ngx_http_upstream_rr_peers_wlock(slots[0].peers);
+    ngx_http_upstream_rr_peers_wlock(slots[1].peers);
+
+    // frees slots first, so that added servers find them.
+    for (i = 0; i < changes->removed.nelts; i++) {
+        s = ((ngx_http_upstream_server_t **)changes->removed.elts)[i];
+        clear_server_slots(&slots[s->backup ? 1 : 0], s);
+    }
+
+    for (i = 0; i < changes->modified.nelts; i++) {
+        pair = (server_pair *)changes->modified.elts + i;
+        if (pair->old->backup != pair->new->backup) {
+            clear_server_slots(&slots[pair->old->backup ? 1 : 0], pair->old);
+        }
+    }
+
+    for (i = 0; i < changes->modified.nelts; i++) {
+        pair = (server_pair *)changes->modified.elts + i;
+        set_server_slots(&slots[pair->new->backup ? 1 : 0], pair->new);
+    }
+
+    for (i = 0; i < changes->added.nelts; i++) {
+        ps = (ngx_http_upstream_server_t **)changes->added.elts + i;
+        set_server_slots(&slots[(*ps)->backup ? 1 : 0], *ps);
+    }
+
+    for (k = 0; k < 2; k++) {
+        if (slots[k].nslots - slots[k].nfree != need[k]) {
+            ngx_log_error(NGX_LOG_INFO, log, 0,
+                "upstream-serverlist: peer slots of serverlist %V differ "
+                "from what was known, reconcile", &sl->name);
+            reconcile_slots(&slots[k], new_servers, k);
+        }
+
+        slots[k].peers->weighted =
+            (slots[k].peers->total_weight != slots[k].peers->number);
+#if nginx_version >= 1011005
+        count_peer_tries(slots[k].peers);
+#endif
+    }
+
+    ngx_http_upstream_rr_peers_unlock(slots[1].peers);
+    ngx_http_upstream_rr_peers_unlock(slots[0].peers);
+
+    uscf->servers = new_servers;
+
+#if (NGX_HTTP_UPSTREAM_CHECK)
+    if (ngx_http_upstream_check_update_upstream_peers(uscf, sl->new_pool) !=
+            NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+            "upstream-serverlist: update check module upstream %V failed",
+            &uscf->host);
+    }
+#endif
+
+    return NGX_OK;
+}
+
+// moves peers of a list into n slots allocated with it, the rest of which
+// are linked as down peers weighing nothing.
+static ngx_int_t
+init_peer_slots(peer_slots *ps, ngx_http_upstream_rr_peers_t *peers,
+    ngx_uint_t n, ngx_slab_pool_t *shpool, ngx_pool_t *pool) {
+    ngx_http_upstream_rr_peer_t *peer = NULL;
+    ngx_uint_t i = 0, nindex = 2;
+
+    while (nindex < n * 2) {
+        nindex <<= 1;
+    }
+
+    ps->slots = slots_calloc(shpool, pool, n * sizeof *ps->slots);
+    ps->free = slots_calloc(shpool, pool, n * sizeof *ps->free);
+    ps->index = slots_calloc(shpool, pool, nindex * sizeof *ps->index);
+    if (ps->slots == NULL || ps->free == NULL || ps->index == NULL) {
+        return NGX_ERROR;
+    }
+
+    ps->peers = peers;
+    ps->nslots = n;
+    ps->mask = nindex - 1;
+
+    for (i = 0, peer = peers->peer; i < n; i++) {
+        if (peer != NULL) {
+            // strings of configured peers live as long as the cycle.
+            ps->slots[i].peer = *peer;
+            ps->slots[i].peer.next = NULL;
+            ps->slots[i].hash = sockaddr_hash(peer->sockaddr, peer->socklen);
+            ps->slots[i].active = 1;
+            index_slot(ps, i);
+            peer = peer->next;
+        } else {
+            ps->slots[i].peer.down = 1;
+            ps->free[ps->nfree++] = n - 1 - (i - peers->number);
+        }
+
+        if (i > 0) {
+            ps->slots[i - 1].peer.next = &ps->slots[i].peer;
+        }
+    }
+
+    peers->peer = &ps->slots[0].peer;
+    peers->number = n;
+    peers->weighted = (peers->total_weight != n);
+#if nginx_version >= 1011005
+    // a backup list made up from the primary one has its tries too.
+    count_peer_tries(peers);
+#endif
+    return NGX_OK;
+}
+
+// reserves max_servers peer slots for each peer list of the serverlist's
+// upstream, in its zone if it has one. called in master process, before any
+// request uses the peers.
+static ngx_int_t
+reserve_peer_slots(serverlist *sl, ngx_cycle_t *cycle) {
+    ngx_http_upstream_srv_conf_t *uscf = sl->upstream_conf;
+    ngx_http_upstream_rr_peers_t *peers = uscf->peer.data, *backup = NULL;
+    ngx_slab_pool_t *shpool = NULL;
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    shpool = peers->shpool;
+#endif
+
+    if (peers->number > sl->max_servers ||
+        (peers->next && peers->next->number > sl->max_servers)) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+            "upstream-serverlist: upstream %V has more servers than "
+            "max_servers=%ui of serverlist %V", &uscf->host, sl->max_servers,
+            &sl->name);
+        return NGX_ERROR;
+    }
+
+    sl->slots = slots_calloc(shpool, cycle->pool, 2 * sizeof *sl->slots);
+    backup = peers->next;
+    if (backup == NULL) {
+        // copied from the primary list to keep fields of the zone.
+        backup = slots_calloc(shpool, cycle->pool, sizeof *backup);
+        if (backup != NULL) {
+            *backup = *peers;
+            backup->next = NULL;
+            backup->peer = NULL;
+            backup->number = 0;
+            backup->total_weight = 0;
+        }
+    }
+
+    if (sl->slots == NULL || backup == NULL ||
+        init_peer_slots(&sl->slots[0], peers, sl->max_servers, shpool,
+            cycle->pool) != NGX_OK ||
+        init_peer_slots(&sl->slots[1], backup, sl->max_servers, shpool,
+            cycle->pool) != NGX_OK) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+            "upstream-serverlist: reserve peer slots of serverlist %V "
+            "failed, peers are rebuilt on change", &sl->name);
+        sl->slots = NULL;
+        return NGX_OK;
+    }
+
+    peers->next = backup;
+    peers->single = 0;
+    return NGX_OK;
+}
+
+// returns NGX_OK if peers were rebuilt in sl->new_pool, NGX_DONE if peers were
+// patched in place, NGX_DECLINED if nothing changed.
+static ngx_int_t
+refresh_upstream(serverlist *sl, ngx_array_t *new_servers, ngx_log_t *log) {
+    ngx_http_upstream_srv_conf_t *uscf = sl->upstream_conf;
+    ngx_http_upstream_rr_peer_t **map = NULL;
+    server_changes changes;
+    server_pair *pair = NULL;
+    ngx_uint_t i = 0;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_int_t ret = NGX_OK;
+#endif
+
+    if (new_servers == NULL || new_servers->nelts <= 0) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+            "upstream-serverlist: parse serverlist %V failed", &sl->name);
+        return NGX_ERROR;
+    }
+
+    if (diff_servers(sl->new_pool, uscf->servers, new_servers,
+            &changes) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+            "upstream-serverlist: diff serverlist %V failed", &sl->name);
+        return NGX_ERROR;
+    }
+
+    if (changes.added.nelts <= 0 && changes.removed.nelts <= 0 &&
+            changes.modified.nelts <= 0) {
+        ngx_log_debug(NGX_LOG_INFO, log, 0,
+            "upstream-serverlist: serverlist %V nothing changed", &sl->name);
+        return NGX_DECLINED;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, log, 0,
+        "upstream-serverlist: serverlist %V changed, added %d removed %d "
+        "modified %d", &sl->name, changes.added.nelts, changes.removed.nelts,
+        changes.modified.nelts);
+
+    if (ngx_process == NGX_PROCESS_HELPER) {
+        // no request goes through the helper process, it keeps servers only
+        // to dump and publish them.
+        uscf->servers = new_servers;
+        return NGX_OK;
+    }
+
+    if (sl->slots != NULL) {
+        return flip_peer_slots(sl, new_servers, &changes, log);
+    }
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (sl->zone != NULL) {
+        ret = rebuild_zone_peers(sl, new_servers, &changes, log);
+        if (ret != NGX_DECLINED) {
+            return ret;
+        }
+
+        // workers share these peers, none may swap in its own. the write is
+        // retried with the next fetch, max_servers= reserves room up front.
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+            "upstream-serverlist: peers of upstream %V can not grow in its "
+            "zone, keep old peers of serverlist %V, set 'max_servers' to "
+            "reserve room", &uscf->host, &sl->name);
+        return NGX_ERROR;
+    }
+#endif
+
+    if (changes.added.nelts <= 0 && changes.removed.nelts <= 0) {
+        for (i = 0; i < changes.modified.nelts; i++) {
+            pair = (server_pair *)changes.modified.elts + i;
+            if (pair->old->backup != pair->new->backup) {
+                break;
+            }
+        }
+
+        if (i >= changes.modified.nelts) {
+            map = map_server_peers(sl->new_pool, uscf->servers,
+                uscf->peer.data);
+        }
+
+        if (map != NULL) {
+            patch_peers(sl, &changes, map);
+            return NGX_DONE;
+        }
+    }
+
+    if (rebuild_peers(sl, new_servers, &changes, log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define xxh_rotl64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t
+xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = xxh_rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static uint64_t
+xxh64_merge_round(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static uint64_t
+xxh64_read64(const u_char *p) {
+    uint64_t v;
+    ngx_memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static uint32_t
+xxh64_read32(const u_char *p) {
+    uint32_t v;
+    ngx_memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static void
+xxh64_consume(xxh64_state *st, const u_char *p) {
+    st->v[0] = xxh64_round(st->v[0], xxh64_read64(p));
+    st->v[1] = xxh64_round(st->v[1], xxh64_read64(p + 8));
+    st->v[2] = xxh64_round(st->v[2], xxh64_read64(p + 16));
+    st->v[3] = xxh64_round(st->v[3], xxh64_read64(p + 24));
+}
+
+// XXH64 with seed 0, fed piece by piece as a body is received. only used to
+// tell whether a body changed since the last refresh, so the native byte
+// order is fine.
+static void
+xxh64_reset(xxh64_state *st) {
+    st->v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    st->v[1] = XXH_PRIME64_2;
+    st->v[2] = 0;
+    st->v[3] = 0 - XXH_PRIME64_1;
+    st->total_len = 0;
+    st->memsize = 0;
+}
+
+static void
+xxh64_update(xxh64_state *st, const u_char *p, size_t len) {
+    const u_char *end = p + len;
+    size_t fill = 0;
+
+    st->total_len += len;
+
+    if (st->memsize + len < sizeof st->mem) {
+        ngx_memcpy(st->mem + st->memsize, p, len);
+        st->memsize += len;
+        return;
+    }
+
+    if (st->memsize > 0) {
+        fill = sizeof st->mem - st->memsize;
+        ngx_memcpy(st->mem + st->memsize, p, fill);
+        xxh64_consume(st, st->mem);
+        p += fill;
+        st->memsize = 0;
+    }
+
+    for (; p + sizeof st->mem <= end; p += sizeof st->mem) {
+        xxh64_consume(st, p);
+    }
+
+    if (p < end) {
+        ngx_memcpy(st->mem, p, end - p);
+        st->memsize = end - p;
+    }
+}
+
+static uint64_t
+xxh64_digest(xxh64_state *st) {
+    const u_char *p = st->mem, *end = st->mem + st->memsize;
+    uint64_t h = 0;
+
+    if (st->total_len >= sizeof st->mem) {
+        h = xxh_rotl64(st->v[0], 1) + xxh_rotl64(st->v[1], 7)
+            + xxh_rotl64(st->v[2], 12) + xxh_rotl64(st->v[3], 18);
+        h = xxh64_merge_round(h, st->v[0]);
+        h = xxh64_merge_round(h, st->v[1]);
+        h = xxh64_merge_round(h, st->v[2]);
+        h = xxh64_merge_round(h, st->v[3]);
+    } else {
+        h = XXH_PRIME64_5;
+    }
+
+    h += st->total_len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh64_round(0, xxh64_read64(p));
+        h = xxh_rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+
+    if (p + 4 <= end) {
+        h ^= (uint64_t)xxh64_read32(p) * XXH_PRIME64_1;
+        h = xxh_rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+
+    for (; p < end; p++) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = xxh_rotl64(h, 11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+#define header_is(h, n) ((h)->name_len == sizeof(n) - 1 &&                  \
+    ngx_strncasecmp((u_char *)(h)->name, (u_char *)n, sizeof(n) - 1) == 0)
+
+// extracts all fields the module needs from the headers in one pass.
+static void
+parse_response_headers(service_conn *sc, struct phr_header *headers,
+    size_t num_headers) {
+    struct phr_header *h = NULL;
+    size_t i = 0;
+
+    sc->content_length = -1;
+    sc->chunked = 0;
+    ngx_str_null(&sc->etag);
+    sc->last_modified = (time_t)-1;
+    sc->index = -1;
+
+    for (i = 0; i < num_headers; i++) {
+        h = &headers[i];
+
+        if (h->name == NULL) {
+            // continuation of a multiline header.
+            continue;
+        }
+
+        if (header_is(h, "Content-Length")) {
+            sc->content_length = ngx_atoi((u_char *)h->value, h->value_len);
+        } else if (header_is(h, "Transfer-Encoding")) {
+            sc->chunked = ngx_strlcasestrn((u_char *)h->value,
+                (u_char *)h->value + h->value_len, (u_char *)"chunked",
+                7 - 1) != NULL;
+        } else if (header_is(h, "Etag")) {
+            sc->etag.data = (u_char *)h->value;
+            sc->etag.len = h->value_len;
+        } else if (header_is(h, "Last-Modified")) {
+            sc->last_modified = ngx_http_parse_time((u_char *)h->value,
+                h->value_len);
+        } else if (header_is(h, "X-Serverlist-Index")) {
+            sc->index = ngx_atoof((u_char *)h->value, h->value_len);
+        }
+    }
+}
+
+// returns 1 if validators etag and last_modified tell serverlist sl is not
+// modified since its last applied body.
+static ngx_int_t
+same_validators(serverlist *sl, ngx_str_t *etag, time_t last_modified) {
+    if (etag->len > 0) {
+        return sl->etag.len == etag->len && ngx_strncasecmp(sl->etag.data,
+            etag->data, etag->len) == 0;
+    }
+
+    return last_modified >= 0 && last_modified <= sl->last_modified;
+}
+
+// creates the pool of a new generation of serverlist sl. it is sized after the
+// last generation, so that a generation usually takes one block, and lets
+// allocations up to its size stay in blocks, so that its bytes are accounted.
+static ngx_pool_t *
+create_arena(serverlist *sl, ngx_log_t *log) {
+    size_t size = ngx_max(sl->arena_size, DEFAULT_SERVERLIST_POOL_SIZE);
+    ngx_pool_t *pool = ngx_create_pool(size, log);
+
+    if (pool == NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+            "upstream-serverlist: create new pool failed");
+        return NULL;
+    }
+
+    // the same bound ngx_create_pool() sets, without the page size cap. a new
+    // block always has room for it.
+    if (size - sizeof(ngx_pool_t) > pool->max) {
+        pool->max = size - sizeof(ngx_pool_t);
+    }
+
+    return pool;
+}
+
+// bytes of the blocks of pool, and of them used in used. allocations bigger
+// than a block are not sized by nginx, they are only counted in nlarge.
+static size_t
+arena_bytes(ngx_pool_t *pool, size_t *used, ngx_uint_t *nlarge) {
+    ngx_pool_t *p = NULL;
+    ngx_pool_large_t *l = NULL;
+    size_t bytes = 0;
+
+    for (p = pool; p != NULL; p = p->d.next) {
+        bytes += p->d.end - (u_char *)p;
+        *used += p->d.last - (u_char *)p;
+    }
+
+    for (l = pool->large; l != NULL; l = l->next) {
+        if (l->alloc != NULL) {
+            (*nlarge)++;
+        }
+    }
+
+    return bytes;
+}
+
+// returns 1 if no request holds peers, and no handoff still forwards from
+// them.
+static ngx_uint_t
+idle_peers(ngx_http_upstream_rr_peers_t *peers, peer_handoff *handoffs) {
+    ngx_http_upstream_rr_peer_t *peer = NULL;
+
+    for (; peers != NULL; peers = peers->next) {
+        for (peer = peers->peer; peer != NULL; peer = peer->next) {
+            if (peer->conns > 0 || handed_off(handoffs, peer)) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+// frees retired peers of sl no request holds any more.
+static void
+release_retired_peers(serverlist *sl) {
+    retired_peers **rp = &sl->retired, *retired = NULL;
+
+    while (*rp != NULL) {
+        retired = *rp;
+        if (!idle_peers(retired->peers, sl->handoffs)) {
+            rp = &retired->next;
+            continue;
+        }
+
+        *rp = retired->next;
+        ngx_destroy_pool(retired->pool);
+    }
+}
+
+static ngx_uint_t
+unsettled_peers(serverlist *sl) {
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (sl->zone != NULL &&
+            (sl->zone->retired != NULL || sl->zone->handoffs != NULL)) {
+        return 1;
+    }
+#endif
+
+    return sl->handoffs != NULL || sl->retired != NULL;
+}
+
+// forwards conns released on retired peers of sl, and frees those no request
+// holds any more. returns 1 if some are still held.
+static ngx_uint_t
+settle_peers(serverlist *sl) {
+    ngx_http_upstream_rr_peers_t *peers = sl->upstream_conf->peer.data;
+    ngx_http_upstream_rr_peers_t *backup = peers->next;
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+    if (backup != NULL) {
+        ngx_http_upstream_rr_peers_wlock(backup);
+    }
+
+    settle_handoffs(&sl->handoffs, NULL);
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (sl->zone != NULL) {
+        settle_handoffs(&sl->zone->handoffs, peers->shpool);
+        free_idle_zone_peers(sl->zone, peers->shpool);
+    }
+#endif
+
+    if (backup != NULL) {
+        ngx_http_upstream_rr_peers_unlock(backup);
+    }
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    // handoffs from them are settled.
+    release_retired_peers(sl);
+
+    return unsettled_peers(sl);
+}
+
+static void
+settle_timer_handler(ngx_event_t *ev) {
+    main_conf *mcf = ev->data;
+    ngx_array_t *lists[2] = {&mcf->serverlists, &mcf->followers};
+    serverlist *sl = NULL;
+    ngx_uint_t i = 0, k = 0, held = 0;
+
+    if (whole_world_exiting()) {
+        return;
+    }
+
+    for (k = 0; k < 2; k++) {
+        for (i = 0; i < lists[k]->nelts; i++) {
+            sl = (serverlist *)lists[k]->elts + i;
+            if (unsettled_peers(sl) && settle_peers(sl)) {
+                held = 1;
+            }
+        }
+    }
+
+    if (held) {
+        ngx_add_timer(ev, SETTLE_PEERS_MS);
+    }
+}
+
+// makes sl->new_pool the current generation. the retired one is released at
+// once, unless it held the peers, which stay in sl->retired until idle.
+static void
+commit_arena(serverlist *sl, ngx_uint_t held_peers, ngx_log_t *log) {
+    main_conf *mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+        ngx_http_upstream_serverlist_module);
+    retired_peers *retired = NULL;
+    ngx_uint_t nlarge = 0;
+    size_t used = 0;
+
+    if (!held_peers && sl->pool != NULL) {
+        ngx_destroy_pool(sl->pool);
+    }
+
+    sl->pool = sl->new_pool;
+    sl->new_pool = NULL;
+    sl->nservers = sl->upstream_conf->servers->nelts;
+
+    sl->bytes = arena_bytes(sl->pool, &used, &nlarge);
+
+    // next generation likely uses as much as this one, and gets bigger
+    // blocks if something did not fit.
+    sl->arena_size = ngx_align(nlarge > 0 ? used * 2 : used, ngx_pagesize);
+
+    if (settle_peers(sl) && !mcf->settle_timer.timer_set) {
+        ngx_add_timer(&mcf->settle_timer, SETTLE_PEERS_MS);
+    }
+
+    for (retired = sl->retired; retired != NULL; retired = retired->next) {
+        sl->bytes += arena_bytes(retired->pool, &used, &nlarge);
+    }
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, log, 0,
+        "upstream-serverlist: serverlist %V holds %uz bytes of pools, %ui "
+        "large allocations", &sl->name, sl->bytes, nlarge);
+}
+
+// starts parsing the lines of serverlist sl, unless its validators etag and
+// last_modified tell it is not modified. returns NGX_ERROR only if the
+// connection should be closed.
+static ngx_int_t
+begin_section(service_conn *sc, serverlist *sl, ngx_str_t *etag,
+    time_t last_modified, ngx_log_t *log) {
+    if (same_validators(sl, etag, last_modified)) {
+        return NGX_OK;
+    }
+
+    if (sl->resolving) {
+        // the last body is not applied yet, fetch it again next round.
+        ngx_log_error(NGX_LOG_INFO, log, 0,
+            "upstream-serverlist: serverlist %V still resolving, skip",
+            &sl->name);
+        return NGX_OK;
+    }
+
+    // validators are stored only once the section is applied, since etag
+    // points into the recv buffer, keep a copy.
+    if (etag->len > sizeof sc->section_etag_data) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+            "upstream-serverlist: etag of serverlist %V too long, ignored",
+            &sl->name);
+        ngx_str_null(&sc->section_etag);
+    } else {
+        ngx_memcpy(sc->section_etag_data, etag->data, etag->len);
+        sc->section_etag.data = sc->section_etag_data;
+        sc->section_etag.len = etag->len;
+    }
+
+    sc->section_last_modified = last_modified;
+
+    if (sl->new_pool != NULL) {
+        // unlikely, is a critical bug.
+        ngx_log_error(NGX_LOG_CRIT, log, 0,
+            "upstream-serverlist: new pool of sl %V is existing",
+            &sl->name);
+        ngx_destroy_pool(sl->new_pool);
+        sl->new_pool = NULL;
+    }
+
+    sl->new_pool = create_arena(sl, log);
+    if (sl->new_pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    // sized after the last generation, so that it is not regrown and copied.
+    sc->section_servers = create_servers(sl->new_pool,
+        ngx_max(sl->nservers, 2));
+    if (sc->section_servers == NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+            "upstream-serverlist: create servers of serverlist %V failed",
+            &sl->name);
+        ngx_destroy_pool(sl->new_pool);
+        sl->new_pool = NULL;
+        return NGX_ERROR;
+    }
+
+    xxh64_reset(&sc->section_hash);
+    sc->section = sl;
+    return NGX_OK;
+}
+
+// drops servers parsed in sl->new_pool, and ensures force refresh in next
+// round.
+static void
+discard_section(serverlist *sl) {
+    sl->last_modified = -1;
+    ngx_memzero(&sl->etag, sizeof sl->etag);
+    sl->body_hash_valid = 0;
+    ngx_destroy_pool(sl->new_pool);
+    sl->new_pool = NULL;
+}
+
+// stores servers applied for serverlist sl as its new generation, for other
+// workers to apply without fetching.
+static void
+publish_section(serverlist *sl, ngx_array_t *servers, ngx_log_t *log) {
+    main_conf *mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+        ngx_http_upstream_serverlist_module);
+    shared_list *shl = sl->shared;
+    size_t size = snapshot_size(servers);
+    u_char *snapshot = NULL;
+
+    ngx_shmtx_lock(&mcf->shpool->mutex);
+
+    snapshot = ngx_slab_alloc_locked(mcf->shpool, size);
+    if (snapshot == NULL) {
+        ngx_shmtx_unlock(&mcf->shpool->mutex);
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+            "upstream-serverlist: shared zone is full, serverlist %V not "
+            "published", &sl->name);
+        return;
+    }
+
+    write_snapshot(snapshot, servers);
+    if (shl->snapshot != NULL) {
+        ngx_slab_free_locked(mcf->shpool, shl->snapshot);
+    }
+
+    shl->snapshot = snapshot;
+    shl->snapshot_len = size;
+    shl->last_modified = sl->last_modified;
+    shl->etag_len = sl->etag.len;
+    ngx_memcpy(shl->etag_data, sl->etag.data, sl->etag.len);
+    shl->index = sl->index;
+    shl->body_hash = sl->body_hash;
+    shl->body_len = sl->body_len;
+    shl->body_hash_valid = sl->body_hash_valid;
+    sl->generation = ++shl->generation;
+
+    ngx_shmtx_unlock(&mcf->shpool->mutex);
+}
+
+// applies servers fetched for sl to the other upstreams of the serverlist,
+// each in a generation of its own, with the validators of sl.
+static void
+apply_followers(serverlist *sl, ngx_array_t *servers, uint64_t body_hash,
+    size_t body_len, ngx_log_t *log) {
+    serverlist **followers = sl->followers->elts, *f = NULL;
+    ngx_array_t *copy = NULL;
+    size_t size = snapshot_size(servers);
+    u_char *snapshot = NULL;
+    ngx_uint_t i = 0;
+
+    // servers are serialized once, and copied out for every upstream.
+    snapshot = ngx_alloc(ngx_max(size, 1), log);
+    if (snapshot == NULL) {
+        return;
+    }
+
+    write_snapshot(snapshot, servers);
+
+    for (i = 0; i < sl->followers->nelts; i++) {
+        f = followers[i];
+
+        f->new_pool = create_arena(f, log);
+        if (f->new_pool == NULL) {
+            continue;
+        }
+
+        copy = read_snapshot(f->new_pool, snapshot, size);
+        if (copy == NULL) {
+            ngx_destroy_pool(f->new_pool);
+            f->new_pool = NULL;
+            continue;
+        }
+
+        f->last_modified = sl->last_modified;
+        f->index = sl->index;
+        f->etag.len = sl->etag.len;
+        f->etag.data = f->etag_data;
+        ngx_memcpy(f->etag_data, sl->etag.data, sl->etag.len);
+
+        apply_section(f, copy, body_hash, body_len, 0, log);
+    }
+
+    ngx_free(snapshot);
+}
+
+// applies servers parsed in sl->new_pool, from a body hashed to body_hash.
+// with publish, other workers get them too.
+static void
+apply_section(serverlist *sl, ngx_array_t *servers, uint64_t body_hash,
+    size_t body_len, ngx_uint_t publish, ngx_log_t *log) {
+    ngx_uint_t held_peers = (sl->pool != NULL && sl->pool == sl->peers_pool);
+    ngx_int_t ret = NGX_OK;
+
+    if (sl->followers != NULL) {
+        apply_followers(sl, servers, body_hash, body_len, log);
+    }
+
+    ret = refresh_upstream(sl, servers, log);
+
+    if (ret == NGX_ERROR) {
+        discard_section(sl);
+        return;
+    }
+
+    sl->body_hash = body_hash;
+    sl->body_len = body_len;
+    sl->body_hash_valid = 1;
+
+    if (publish && sl->shared != NULL) {
+        publish_section(sl, servers, log);
+    }
+
+    if (publish && ret != NGX_DECLINED) {
+        // the worker that fetched dumps, others apply the same servers.
+        dump_serverlist(sl);
+        schedule_snapshot();
+    }
+
+    if (ret != NGX_OK) {
+        // nothing in new pool is referenced by the upstream.
+        ngx_destroy_pool(sl->new_pool);
+        sl->new_pool = NULL;
+        return;
+    }
+
+    // the new pool holds the new servers, and peers if rebuilt.
+    commit_arena(sl, held_peers, log);
+}
+
+// applies the generation another worker published for serverlist sl, if it
+// is not the one applied here.
+static void
+sync_serverlist(serverlist *sl, ngx_log_t *log) {
+    main_conf *mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+        ngx_http_upstream_serverlist_module);
+    shared_list *shl = sl->shared;
+    ngx_array_t *servers = NULL;
+    uint64_t body_hash = 0;
+    size_t body_len = 0;
+
+    // a racy peek, the generation is checked again under lock.
+    if (shl == NULL || shl->generation == sl->generation ||
+            sl->new_pool != NULL || sl->resolving) {
+        return;
+    }
+
+    sl->new_pool = create_arena(sl, log);
+    if (sl->new_pool == NULL) {
+        return;
+    }
+
+    ngx_shmtx_lock(&mcf->shpool->mutex);
+
+    if (shl->snapshot != NULL && shl->generation != sl->generation) {
+        servers = read_snapshot(sl->new_pool, shl->snapshot,
+            shl->snapshot_len);
+        sl->generation = shl->generation;
+        sl->last_modified = shl->last_modified;
+        sl->etag.len = shl->etag_len;
+        sl->etag.data = sl->etag_data;
+        ngx_memcpy(sl->etag_data, shl->etag_data, shl->etag_len);
+        sl->index = shl->index;
+        body_hash = shl->body_hash;
+        body_len = shl->body_len;
+    }
+
+    ngx_shmtx_unlock(&mcf->shpool->mutex);
+
+    if (servers == NULL) {
+        ngx_destroy_pool(sl->new_pool);
+        sl->new_pool = NULL;
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, log, 0,
+        "upstream-serverlist: serverlist %V synced generation %uL from "
+        "shared zone", &sl->name, sl->generation);
+    apply_section(sl, servers, body_hash, body_len, 0, log);
+}
+
+static void
+sync_timer_handler(ngx_event_t *ev) {
+    main_conf *mcf = ev->data;
+    serverlist *sl = NULL;
+    ngx_msec_t interval = watch_timeout_ms > 0 ? WATCH_SYNC_MS
+        : DEFAULT_HELPER_SYNC_MS;
+    ngx_uint_t i = 0;
+
+    if (whole_world_exiting()) {
+        return;
+    }
+
+    for (i = 0; i < mcf->serverlists.nelts; i++) {
+        sl = (serverlist *)mcf->serverlists.elts + i;
+        sync_serverlist(sl, ev->log);
+        interval = ngx_min(interval, interval_of(sl));
+    }
+
+    ngx_add_timer(ev, interval);
+}
+
+static void
+finish_resolve(resolve_job *job) {
+    serverlist *sl = job->sl;
+
+    sl->resolving = 0;
+
+    if (whole_world_exiting()) {
+        ngx_destroy_pool(sl->new_pool);
+        sl->new_pool = NULL;
+        return;
+    }
+
+    if (job->failed > 0) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+            "upstream-serverlist: resolve %ui names of serverlist %V failed, "
+            "keep current servers", job->failed, &sl->name);
+        discard_section(sl);
+        return;
+    }
+
+    apply_section(sl, job->servers, job->body_hash, job->body_len, 1,
+        ngx_cycle->log);
+}
+
+static void
+resolve_handler(ngx_resolver_ctx_t *ctx) {
+    resolve_name *rn = ctx->data;
+    resolve_job *job = rn->job;
+    ngx_pool_t *pool = job->sl->new_pool;
+    ngx_addr_t *addrs = NULL;
+    struct sockaddr *sockaddr = NULL;
+    socklen_t socklen = 0;
+    u_char *p = NULL;
+    ngx_uint_t i = 0;
+
+    if (ctx->state) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+            "upstream-serverlist: resolve %V of serverlist %V failed: %s",
+            &ctx->name, &job->sl->name, ngx_resolver_strerror(ctx->state));
+        job->failed++;
+        goto done;
+    }
+
+    if (ctx->naddrs == 0) {
+        // left without addresses, the server would be taken for an
+        // unresolved name again.
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+            "upstream-serverlist: resolve %V of serverlist %V failed: no "
+            "address", &ctx->name, &job->sl->name);
+        job->failed++;
+        goto done;
+    }
+
+    addrs = ngx_pcalloc(pool, ctx->naddrs * sizeof(ngx_addr_t));
+    if (addrs == NULL) {
+        job->failed++;
+        goto done;
+    }
+
+    for (i = 0; i < ctx->naddrs; i++) {
+        socklen = ctx->addrs[i].socklen;
+        sockaddr = ngx_palloc(pool, socklen);
+        p = ngx_pnalloc(pool, NGX_SOCKADDR_STRLEN);
+        if (sockaddr == NULL || p == NULL) {
+            job->failed++;
+            goto done;
+        }
+
+        ngx_memcpy(sockaddr, ctx->addrs[i].sockaddr, socklen);
+        ngx_inet_set_port(sockaddr, rn->port);
+
+        addrs[i].sockaddr = sockaddr;
+        addrs[i].socklen = socklen;
+        addrs[i].name.data = p;
+        addrs[i].name.len = ngx_sock_ntop(sockaddr, socklen, p,
+            NGX_SOCKADDR_STRLEN, 1);
+    }
+
+    rn->server->addrs = addrs;
+    rn->server->naddrs = ctx->naddrs;
+
+done:
+    ngx_resolve_name_done(ctx);
+
+    if (--job->pending == 0) {
+        finish_resolve(job);
+    }
+}
+
+// resolves hostnames among servers of serverlist sl through the resolver of
+// http block, and applies the servers once all names are resolved. answers
+// are cached by the resolver as long as their TTL. returns NGX_DECLINED if
+// there is no hostname, NGX_ERROR if resolving could not start.
+static ngx_int_t
+resolve_section(serverlist *sl, ngx_array_t *servers, uint64_t body_hash,
+    size_t body_len, ngx_log_t *log) {
+    main_conf *mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+        ngx_http_upstream_serverlist_module);
+    ngx_http_core_loc_conf_t *clcf =
+        mcf->conf_ctx->loc_conf[ngx_http_core_module.ctx_index];
+    ngx_http_upstream_server_t *server = servers->elts;
+    resolve_job *job = NULL;
+    resolve_name *rn = NULL;
+    ngx_resolver_ctx_t *ctx = NULL;
+    ngx_url_t u;
+    ngx_uint_t i = 0;
+
+    for (i = 0; i < servers->nelts; i++) {
+        if (server[i].naddrs <= 0) {
+            break;
+        }
+    }
+
+    if (i >= servers->nelts) {
+        return NGX_DECLINED;
+    }
+
+    job = ngx_pcalloc(sl->new_pool, sizeof *job);
+    if (job == NULL) {
+        return NGX_ERROR;
+    }
+
+    job->sl = sl;
+    job->servers = servers;
+    job->body_hash = body_hash;
+    job->body_len = body_len;
+    job->pending = 1; // released once all names started.
+    sl->resolving = 1;
+
+    for (; i < servers->nelts; i++) {
+        if (server[i].naddrs > 0) {
+            continue;
+        }
+
+        ngx_memzero(&u, sizeof u);
+        u.url = server[i].name;
+        u.default_port = 80;
+        u.no_resolve = 1;
+        if (ngx_parse_url(sl->new_pool, &u) != NGX_OK) {
+            job->failed++;
+            continue;
+        }
+
+        ctx = clcf->resolver ? ngx_resolve_start(clcf->resolver, NULL)
+            : NGX_NO_RESOLVER;
+        if (ctx == NGX_NO_RESOLVER) {
+            // resolving blocking would stall the worker.
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                "upstream-serverlist: no resolver defined to resolve %V of "
+                "serverlist %V", &u.host, &sl->name);
+            job->failed++;
+            continue;
+        }
+
+        if (ctx == NULL) {
+            job->failed++;
+            continue;
+        }
+
+        rn = ngx_palloc(sl->new_pool, sizeof *rn);
+        if (rn == NULL) {
+            ngx_resolve_name_done(ctx);
+            job->failed++;
+            continue;
+        }
+
+        rn->job = job;
+        rn->server = &server[i];
+        rn->port = u.port;
+
+        ctx->name = u.host;
+        ctx->handler = resolve_handler;
+        ctx->data = rn;
+        ctx->timeout = clcf->resolver_timeout;
+
+        // the handler may be called right here if the answer is cached.
+        job->pending++;
+        if (ngx_resolve_name(ctx) != NGX_OK) {
+            job->pending--;
+            job->failed++;
+        }
+    }
+
+    if (--job->pending == 0) {
+        finish_resolve(job);
+    }
+
+    return NGX_OK;
+}
+
+// applies the servers parsed of the section, once all its lines are fed.
+static void
+end_section(service_conn *sc, ngx_log_t *log) {
+    main_conf *mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+        ngx_http_upstream_serverlist_module);
+    serverlist *sl = sc->section;
+    ngx_array_t *servers = sc->section_servers;
+    uint64_t body_hash = 0;
+    size_t body_len = sc->section_hash.total_len;
+
+    if (sl == NULL) {
+        return;
+    }
+
+    sc->section = NULL;
+    sc->section_servers = NULL;
+
+    sl->etag = sc->section_etag;
+    if (sl->etag.len > 0) {
+        ngx_memcpy(sl->etag_data, sc->section_etag.data, sc->section_etag.len);
+        sl->etag.data = sl->etag_data;
+    }
+
+    if (sc->section_last_modified < 0) {
+        sl->last_modified = -1;
+    } else if (sc->section_last_modified > sl->last_modified) {
+        sl->last_modified = sc->section_last_modified;
+    }
+
+    // most services do not send validators, so a body identical to the last
+    // applied one is detected here, before it is diffed against the peers.
+    // lines are parsed as they arrive, so its servers were parsed already,
+    // keeping no body around costs that.
+    body_hash = xxh64_digest(&sc->section_hash);
+    if (sl->body_hash_valid && sl->body_hash == body_hash &&
+            sl->body_len == body_len) {
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, log, 0,
+            "upstream-serverlist: serverlist %V body unchanged, skip",
+            &sl->name);
+
+        // summed up at most once per interval, not once per serverlist.
+        mcf->body_unchanged++;
+        if (ngx_current_msec - mcf->unchanged_logged
+                >= (ngx_msec_t) refresh_interval_ms) {
+            ngx_log_error(NGX_LOG_INFO, log, 0,
+                "upstream-serverlist: unchanged bodies skipped in the last "
+                "%Mms: %ui", ngx_current_msec - mcf->unchanged_logged,
+                mcf->body_unchanged);
+            mcf->body_unchanged = 0;
+            mcf->unchanged_logged = ngx_current_msec;
+        }
+        ngx_destroy_pool(sl->new_pool);
+        sl->new_pool = NULL;
+        return;
+    }
+
+    switch (resolve_section(sl, servers, body_hash, body_len, log)) {
+    case NGX_DECLINED:
+        apply_section(sl, servers, body_hash, body_len, 1, log);
+        break;
+
+    case NGX_ERROR:
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+            "upstream-serverlist: resolve serverlist %V failed", &sl->name);
+        discard_section(sl);
+        break;
+
+    default:
+        // applied once resolved.
+        break;
+    }
+}
+
+// parses validators kept in the first line of a dump into sl, returns the body
+// hash and length it was built from, or 0 if absent.
+static void
+parse_dump_header(serverlist *sl, ngx_str_t *header, uint64_t *body_hash,
+    size_t *body_len) {
+    ngx_str_t arg = {0};
+    u_char *pos = header->data, *end = header->data + header->len, *p = NULL;
+    ngx_int_t n = 0;
+
+    while (pos < end) {
+        while (pos < end && (*pos == ' ' || *pos == '\t')) {
+            pos++;
+        }
+
+        arg.data = pos;
+        while (pos < end && *pos != ' ' && *pos != '\t' && *pos != '\r') {
+            pos++;
+        }
+        arg.len = pos - arg.data;
+
+        if (pos < end && *pos == '\r') {
+            // a dump edited with CRLF line endings, the line ends here.
+            end = pos;
+        }
+
+        if (arg.len > 5 && ngx_strncmp(arg.data, "etag=", 5) == 0) {
+            if (arg.len - 5 <= sizeof sl->etag_data) {
+                sl->etag.len = arg.len - 5;
+                sl->etag.data = sl->etag_data;
+                ngx_memcpy(sl->etag_data, arg.data + 5, sl->etag.len);
+            }
+        } else if (arg.len > 14 &&
+                ngx_strncmp(arg.data, "last_modified=", 14) == 0) {
+            sl->last_modified = ngx_atotm(arg.data + 14, arg.len - 14);
+        } else if (arg.len > 6 && ngx_strncmp(arg.data, "index=", 6) == 0) {
+            sl->index = ngx_max(ngx_atoof(arg.data + 6, arg.len - 6), 0);
+        } else if (arg.len == 26 &&
+                ngx_strncmp(arg.data, "body_hash=", 10) == 0) {
+            // ngx_hextoi() takes no more than 63 bits.
+            for (*body_hash = 0, p = arg.data + 10; p < pos; p++) {
+                n = ngx_hextoi(p, 1);
+                if (n == NGX_ERROR) {
+                    *body_hash = 0;
+                    break;
+                }
+                *body_hash = (*body_hash << 4) | n;
+            }
+        } else if (arg.len > 9 && ngx_strncmp(arg.data, "body_len=", 9) == 0) {
+            n = ngx_atosz(arg.data + 9, arg.len - 9);
+            *body_len = n == NGX_ERROR ? 0 : n;
+        }
+    }
+}
+
+// installs servers dumped into conf_dump_dir by the last run, before the first
+// request, so that the upstream does not wait for the serverlist service. the
+// validators of the dump make the first fetch conditional.
+static void
+load_dump(serverlist *sl, ngx_log_t *log) {
+    main_conf *mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+        ngx_http_upstream_serverlist_module);
+    u_char file[MAX_CONF_DUMP_PATH_LENGTH] = {0};
+    u_char *data = NULL, *pos = NULL, *end = NULL, *lf = NULL;
+    ngx_array_t *servers = NULL;
+    ngx_file_info_t fi;
+    ngx_str_t line = {0};
+    ngx_fd_t fd = NGX_INVALID_FILE;
+    uint64_t body_hash = 0;
+    size_t body_len = 0, size = 0;
+    ssize_t n = 0;
+
+    if (mcf->conf_dump_dir.len <= 0 || sl->body_hash_valid) {
+        return;
+    }
+
+    ngx_snprintf(file, sizeof file - 1, "%V/%V.conf%Z", &mcf->conf_dump_dir,
+        &sl->name);
+
+    fd = ngx_open_file(file, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        if (ngx_errno != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_WARN, log, ngx_errno,
+                "upstream-serverlist: " ngx_open_file_n " %s failed", file);
+        }
+        return;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_WARN, log, ngx_errno,
+            "upstream-serverlist: " ngx_fd_info_n " %s failed", file);
+        goto close;
+    }
+
+    sl->new_pool = create_arena(sl, log);
+    if (sl->new_pool == NULL) {
+        goto close;
+    }
+
+    // servers keep no pointer into the file data.
+    size = ngx_file_size(&fi);
+    data = ngx_alloc(ngx_max(size, 1), log);
+    servers = create_servers(sl->new_pool, 2);
+    if (data == NULL || servers == NULL) {
+        goto failed;
+    }
+
+    for (pos = data; pos < data + size; pos += n) {
+        n = ngx_read_fd(fd, pos, data + size - pos);
+        if (n <= 0) {
+            ngx_log_error(NGX_LOG_WARN, log, ngx_errno,
+                "upstream-serverlist: " ngx_read_fd_n " %s failed", file);
+            goto failed;
+        }
+    }
+
+    ngx_close_file(fd);
+    fd = NGX_INVALID_FILE;
+
+    for (pos = data, end = data + size; pos < end; pos = lf + 1) {
+        lf = ngx_strlchr(pos, end, '\n');
+        if (lf == NULL) {
+            lf = end;
+        }
+
+        line.data = pos;
+        line.len = lf - pos;
+
+        if (line.len > 13 && ngx_strncmp(pos, "# serverlist ", 13) == 0) {
+            parse_dump_header(sl, &line, &body_hash, &body_len);
+        } else if (line.len > 0 && *pos != '#') {
+            parse_server_line(sl->new_pool, servers, &line, log);
+        }
+    }
+
+    ngx_free(data);
+    data = NULL;
+
+    if (servers->nelts <= 0) {
+        goto failed;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, log, 0,
+        "upstream-serverlist: serverlist %V loaded %ui servers from %s",
+        &sl->name, servers->nelts, file);
+
+    // as if the body the dump was built from was fetched again, a dump from
+    // before validators were kept has no body hash, and matches no body.
+    switch (resolve_section(sl, servers, body_hash, body_len, log)) {
+    case NGX_DECLINED:
+        apply_section(sl, servers, body_hash, body_len, 0, log);
+        break;
+
+    case NGX_ERROR:
+        discard_section(sl);
+        break;
+
+    default:
+        // applied once resolved.
+        break;
+    }
+
+    return;
+
+failed:
+    ngx_log_error(NGX_LOG_WARN, log, 0,
+        "upstream-serverlist: load dump %s of serverlist %V failed", file,
+        &sl->name);
+    discard_section(sl);
+
+    if (data != NULL) {
+        ngx_free(data);
+    }
+
+close:
+    if (fd != NGX_INVALID_FILE) {
+        ngx_close_file(fd);
+    }
+}
+
+// finds serverlist name, starting at the one after the last found, since
+// serverlists are usually in the order they were written.
+static serverlist *
+find_serverlist(main_conf *mcf, ngx_str_t *name, ngx_uint_t *cursor) {
+    serverlist *sl = NULL;
+    ngx_uint_t i = 0, k = 0;
+
+    for (i = 0; i < mcf->serverlists.nelts; i++) {
+        k = (*cursor + i) % mcf->serverlists.nelts;
+        sl = (serverlist *)mcf->serverlists.elts + k;
+        if (sl->name.len == name->len &&
+                ngx_strncmp(sl->name.data, name->data, name->len) == 0) {
+            *cursor = k + 1;
+            return sl;
+        }
+    }
+
+    return NULL;
+}
+
+// installs servers of all serverlists in the snapshot file, with their
+// addresses resolved when it was written.
+static void
+load_snapshot_file(main_conf *mcf, ngx_log_t *log) {
+    snapshot_file_header header;
+    snapshot_list sn;
+    serverlist *sl = NULL;
+    ngx_array_t *servers = NULL;
+    ngx_file_info_t fi;
+    ngx_str_t name = {0}, etag = {0};
+    ngx_fd_t fd = NGX_INVALID_FILE;
+    u_char *data = NULL, *p = NULL, *end = NULL, *servers_data = NULL;
+    size_t size = 0;
+    ngx_uint_t i = 0, cursor = 0, loaded = 0;
+
+    if (mcf->snapshot_file.len <= 0) {
+        return;
+    }
+
+    fd = ngx_open_file(mcf->snapshot_file.data, NGX_FILE_RDONLY,
+        NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        if (ngx_errno != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_WARN, log, ngx_errno,
+                "upstream-serverlist: " ngx_open_file_n " %V failed",
+                &mcf->snapshot_file);
+        }
+        return;
     }
-    new_sc->send.end = new_sc->send.start + MAX_HTTP_REQUEST_SIZE;
-    new_sc->send.last = new_sc->send.pos = new_sc->send.start;
 
-    new_sc->recv.start = ngx_pcalloc(tmp_mcf->conf_pool, ngx_pagesize);
-    if (new_sc->recv.start == NULL) {
-        ngx_log_error(NGX_LOG_ERR, log, 0,
-            "upstream-serverlist: new allocate recv buffer failed");
-        return NGX_ERROR;
-    }
-    new_sc->recv.end = new_sc->recv.start + MAX_HTTP_REQUEST_SIZE;
-    new_sc->recv.last = new_sc->recv.pos = new_sc->recv.start;
-
-    ngx_memzero(&new_sc->peer_conn, sizeof new_sc->peer_conn);
-    new_sc->peer_conn.data = NULL;
-    new_sc->peer_conn.log = log;
-    new_sc->peer_conn.log_error = NGX_ERROR_ERR;
-    new_sc->peer_conn.connection = NULL;
-    new_sc->peer_conn.get = ngx_event_get_peer;
-    new_sc->peer_conn.name = &tmp_mcf->service_url.host;
-    new_sc->peer_conn.sockaddr = &tmp_mcf->service_url.sockaddr.sockaddr;
-    new_sc->peer_conn.socklen = tmp_mcf->service_url.socklen;
-
-    //new_servers = get_servers(mcf->conf_pool, body, log);
-    new_servers = get_servers(tmp_mcf->conf_pool, body, log);
-    if (new_servers == NULL || new_servers->nelts <= 0) {
-        ngx_log_error(NGX_LOG_ERR, log, 0,
-            "upstream-serverlist: parse serverlist %V failed", &sl->name);
-        return -1;
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_WARN, log, ngx_errno,
+            "upstream-serverlist: " ngx_fd_info_n " %V failed",
+            &mcf->snapshot_file);
+        ngx_close_file(fd);
+        return;
     }
 
-    if (!upstream_servers_changed(uscf->servers, new_servers)) {
-        if (tmp_mcf->conf_pool != NULL) {
-            // destry temp pool
-            ngx_destroy_pool(tmp_mcf->conf_pool);
-            tmp_mcf->conf_pool = NULL;
-        }
-        ngx_log_debug(NGX_LOG_INFO, log, 0,
-            "upstream-serverlist: serverlist %V nothing changed",&sl->name);
-        // once return -1, everything in the old pool will kept and the new pool
-        // will discard, which is we hope for.
-        return -1;
+    size = ngx_file_size(&fi);
+    if (size < sizeof header) {
+        ngx_close_file(fd);
+        goto corrupted;
     }
 
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ngx_close_file(fd);
+    if (data == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_WARN, log, ngx_errno,
+            "upstream-serverlist: mmap() %V failed", &mcf->snapshot_file);
+        return;
+    }
 
-    ngx_memzero(&cf, sizeof cf);
-    cf.name = "serverlist_init_upstream";
-    cf.cycle = (ngx_cycle_t *) ngx_cycle;
+    ngx_memcpy(&header, data, sizeof header);
+    if (ngx_memcmp(header.magic, SNAPSHOT_FILE_MAGIC, sizeof header.magic)
+            != 0 || header.len != size) {
+        goto corrupted;
+    }
 
-    
-    cf.pool = tmp_mcf->conf_pool;
-    cf.module_type = NGX_HTTP_MODULE;
-    cf.cmd_type = NGX_HTTP_MAIN_CONF;
-    cf.log = ngx_cycle->log;
-    cf.ctx = tmp_mcf->conf_ctx;
+    p = data + sizeof header;
+    end = data + size;
 
-    ngx_array_t *old_servers = uscf->servers;
-    uscf->servers = new_servers;
+    for (i = 0; i < header.nlists; i++) {
+        if ((size_t)(end - p) < sizeof sn) {
+            goto corrupted;
+        }
 
-    ngx_array_t *old_service_conns = &mcf->service_conns;
-    ngx_array_t *old_serverlists = &mcf->serverlists;
+        ngx_memcpy(&sn, p, sizeof sn);
+        p += sizeof sn;
+        if ((uint64_t)(end - p) < sn.name_len + sn.etag_len + sn.servers_len) {
+            goto corrupted;
+        }
 
-    ngx_uint_t blocksize = 0;
-    if (tmp_mcf->serverlists.nelts >= tmp_mcf->service_concurrency) {
-        blocksize = (tmp_mcf->serverlists.nelts + (tmp_mcf->service_concurrency - 1))
-            / tmp_mcf->service_concurrency;
-    } else {
-        blocksize = 1;
-    }
+        name.data = p;
+        name.len = sn.name_len;
+        etag.data = p + sn.name_len;
+        etag.len = sn.etag_len;
+        servers_data = etag.data + etag.len;
+        p = servers_data + sn.servers_len;
+
+        sl = find_serverlist(mcf, &name, &cursor);
+        if (sl == NULL || sl->body_hash_valid ||
+                etag.len > sizeof sl->etag_data) {
+            // removed from nginx.conf since, or kept in the shared zone.
+            continue;
+        }
 
-    new_sc->serverlists_start = ngx_min(tmp_mcf->serverlists.nelts,
-            0 + blocksize);
-    new_sc->serverlists_end = ngx_min(tmp_mcf->serverlists.nelts,
-            new_sc->serverlists_start + blocksize);
-    new_sc->serverlists_curr = new_sc->serverlists_start;
+        sl->new_pool = create_arena(sl, log);
+        if (sl->new_pool == NULL) {
+            continue;
+        }
 
-    for (ngx_uint_t i = 0; i < tmp_mcf->service_conns.nelts; i++) {
-        service_conn *tmp_sc = (service_conn *)tmp_mcf->service_conns.elts + i;
-        tmp_sc->timeout_timer.handler = refresh_timeout_handler;
-        tmp_sc->timeout_timer.log = log;
-        tmp_sc->timeout_timer.data = tmp_sc;
-        tmp_sc->refresh_timer.handler = connect_to_service;
-        tmp_sc->refresh_timer.log = log;
-        tmp_sc->refresh_timer.data = tmp_sc;
-        if ((ngx_uint_t)tmp_sc->serverlists_start < tmp_mcf->serverlists.nelts) {
-            ngx_add_timer(&tmp_sc->refresh_timer, random_interval_ms());
+        servers = read_snapshot(sl->new_pool, servers_data, sn.servers_len);
+        if (servers == NULL) {
+            ngx_destroy_pool(sl->new_pool);
+            sl->new_pool = NULL;
+            goto corrupted;
         }
-    }
 
+        sl->last_modified = sn.last_modified;
+        sl->index = sn.index;
+        sl->etag.len = etag.len;
+        sl->etag.data = sl->etag_data;
+        ngx_memcpy(sl->etag_data, etag.data, etag.len);
 
-    if (ngx_http_upstream_init_round_robin(&cf, uscf) != NGX_OK) {
-        // see: https://github.com/GUI/nginx-upstream-dynamic-servers/pull/33/files
-        /* if you read the native code you can find out that all you need to do here is ngx_http_upstream_init_round_robin if you don't use other third party modules in the init process,
-            otherwise it may cause memory problem if you use keepalive in the upstream block (it reinitialize the keepalive queue, when remote close the connection 2 TTL later, it will crash)
-        */
-        ngx_log_error(NGX_LOG_ERR, log, 0,
-            "upstream-serverlist: refresh upstream %V failed, rollback it",
-            &uscf->host);
-        // cf.pool = sl->pool;
-        uscf->servers = old_servers;
-        // this may not work if old servers do not exist?
-        ngx_http_upstream_init_round_robin(&cf, uscf);
-        return -1;
+        apply_section(sl, servers, sn.body_hash, sn.body_len, 0, log);
+        loaded++;
     }
 
-#if (NGX_HTTP_UPSTREAM_CHECK)
-    if (ngx_http_upstream_check_update_upstream_peers(uscf, cf.pool) !=
-            NGX_OK) {
-        ngx_log_error(NGX_LOG_ERR, log, 0,
-            "upstream-serverlist: update check module upstream %V failed",
-            &uscf->host);
-    }
-#endif
+    munmap(data, size);
+    ngx_log_error(NGX_LOG_INFO, log, 0,
+        "upstream-serverlist: loaded %ui serverlists from snapshot %V",
+        loaded, &mcf->snapshot_file);
+    return;
 
-    ngx_shm_t shm = {0};
-    shm.size = CACHE_LINE_SIZE * tmp_mcf->serverlists.nelts;
-    shm.log = log;
-    ngx_str_set(&shm.name, "upstream-serverlist-shared-zone");
-    if (ngx_shm_alloc(&shm) != NGX_OK) {
-        return -1;
+corrupted:
+    ngx_log_error(NGX_LOG_WARN, log, 0,
+        "upstream-serverlist: snapshot %V corrupted, %ui serverlists loaded",
+        &mcf->snapshot_file, loaded);
+
+    if (data != NULL) {
+        munmap(data, size);
     }
-    for (ngx_uint_t i = 0; i < tmp_mcf->serverlists.nelts; i++) {
-        serverlist *temp_sl = (serverlist *)tmp_mcf->serverlists.elts + i;
-        ngx_int_t ret = ngx_shmtx_create(&temp_sl->dump_file_lock,
-            (ngx_shmtx_sh_t *)(shm.addr + CACHE_LINE_SIZE * i), NULL);
-        if ( ret != NGX_OK) {
-            return -1;
-        }
+}
+
+// a batch body is the concatenation of sections like below, one per requested
+// serverlist, in any order:
+//
+//   serverlist <name> [etag=<etag>] [last_modified=<unix time>] [index=<index>]
+//              [not_modified];
+//   server 127.0.0.1:80;
+//   ...
+static ngx_int_t
+is_section_header(ngx_str_t *line) {
+    u_char *pos = line->data, *end = line->data + line->len;
+
+    while (pos < end && (*pos == ' ' || *pos == '\t')) {
+        pos++;
     }
 
-    dump_serverlist(new_sl);
+    return end - pos > 11 && ngx_strncmp(pos, "serverlist", 10) == 0 &&
+        (pos[10] == ' ' || pos[10] == '\t');
+}
 
-    serverlist *old_sls = mcf->serverlists.elts;
+// starts the section of a batch response whose header line is header.
+// returns NGX_ERROR only if the connection should be closed.
+static ngx_int_t
+begin_batch_section(service_conn *sc, ngx_str_t *header, ngx_log_t *log) {
+    serverlist *sl = NULL;
+    ngx_str_t arg = {0}, name = {0}, etag = {0};
+    time_t last_modified = -1;
+    off_t index = NGX_ERROR;
+    ngx_uint_t i = 0, not_modified = 0;
+    ngx_uint_t first = sc->serverlists_curr, count = sc->response_count;
+    u_char *pos = header->data, *end = header->data + header->len;
+
+    for (i = 0; pos < end; i++) {
+        while (pos < end && (*pos == ' ' || *pos == '\t')) {
+            pos++;
+        }
 
-    for (ngx_uint_t i = 0; i < mcf->serverlists.nelts; i++) {
+        arg.data = pos;
+        while (pos < end && *pos != ' ' && *pos != '\t' && *pos != ';' &&
+                *pos != '\r') {
+            pos++;
+        }
+        arg.len = pos - arg.data;
 
-        if (old_sls[i].pool) {
-            ngx_destroy_pool(old_sls[i].pool);
-            old_sls[i].pool = NULL;
+        if (pos < end && (*pos == ';' || *pos == '\r')) {
+            end = pos;
         }
 
-        if (old_sls[i].new_pool) {
-            ngx_destroy_pool(old_sls[i].new_pool);
-            old_sls[i].new_pool = NULL;
+        if (arg.len <= 0) {
+            continue;
+        } else if (i == 1) {
+            name = arg;
+        } else if (arg.len > 5 && ngx_strncmp(arg.data, "etag=", 5) == 0) {
+            etag.data = arg.data + 5;
+            etag.len = arg.len - 5;
+        } else if (arg.len > 14 &&
+                ngx_strncmp(arg.data, "last_modified=", 14) == 0) {
+            last_modified = ngx_atotm(arg.data + 14, arg.len - 14);
+        } else if (arg.len > 6 && ngx_strncmp(arg.data, "index=", 6) == 0) {
+            index = ngx_atoof(arg.data + 6, arg.len - 6);
+        } else if (arg.len == 12 &&
+                ngx_strncmp(arg.data, "not_modified", 12) == 0) {
+            not_modified = 1;
         }
     }
 
-    if (old_servers != NULL) {
-        // destry old old_servers
-        ngx_array_destroy(old_servers);
-        old_servers = NULL;
+    for (i = first; i < first + count; i++) {
+        sl = claimed_serverlist(sc, i);
+        if (sl->name.len == name.len &&
+                ngx_strncmp(sl->name.data, name.data, name.len) == 0) {
+            break;
+        }
     }
 
-    if (old_service_conns != NULL) {
-        // destroy old conns
-        ngx_array_destroy(old_service_conns);
-        old_service_conns = NULL;
+    if (i >= first + count) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+            "upstream-serverlist: batch section of unrequested serverlist %V",
+            &name);
+        return NGX_OK;
     }
 
-    if (old_serverlists != NULL) {
-        // destroy old old_serverlists
-        ngx_array_destroy(old_serverlists);
-        old_serverlists = NULL;
+    // a section skipped while the last one resolves keeps the old index, so
+    // that the change is asked again, after an interval.
+    if (index >= 0 && !sl->resolving) {
+        sl->index = index;
+    } else if (watch_timeout_ms > 0) {
+        sl->index_missed = 1;
     }
 
-    if (tmp_mcf->conf_pool_count > 0){
-        //destry previous pool
-        if (tmp_mcf->prev_conf_pool != NULL) {
-            // destry old conf_pool
-            ngx_destroy_pool(tmp_mcf->prev_conf_pool);
-            tmp_mcf->prev_conf_pool = NULL;
-        }
+    if (not_modified) {
+        return NGX_OK;
     }
-    
-    tmp_mcf->prev_conf_pool = mcf->conf_pool;
-    tmp_mcf->conf_pool_count++;
-    return 0;
-}
 
-static struct phr_header *
-get_header(struct phr_header *headers, size_t num_headers, const char * name) {
-    struct phr_header *h = NULL;
-    size_t i = 0;
+    return begin_section(sc, sl, &etag, last_modified, log);
+}
 
-    if (headers == NULL || num_headers <= 0 || name == NULL) {
-        return NULL;
+// parses the complete lines received of the response body, and the last
+// partial one too once the body is done. a partial line is left in sc->body
+// for the next call. returns NGX_ERROR only if the connection should be
+// closed.
+static ngx_int_t
+consume_body(service_conn *sc, ngx_log_t *log) {
+    main_conf *mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+        ngx_http_upstream_serverlist_module);
+    u_char *pos = sc->body.data, *end = sc->body.data + sc->body.len;
+    u_char *lf = NULL, *next = NULL;
+    ngx_str_t line = {0};
+
+    if (sc->status != 200) {
+        // discarded.
+        sc->body.data = end;
+        sc->body.len = 0;
+        return NGX_OK;
     }
 
-    for (i = 0; i < num_headers; i++) {
-        h = &headers[i];
-
-        if (h->name == NULL && h->value == NULL) {
+    while (pos < end) {
+        lf = ngx_strlchr(pos, end, '\n');
+        if (lf == NULL && !sc->body_done) {
             break;
         }
 
-        if (ngx_strncasecmp((u_char *)h->name, (u_char *)name,
-            h->name_len) == 0) {
-            return h;
+        next = lf == NULL ? end : lf + 1;
+        line.data = pos;
+        line.len = (lf == NULL ? end : lf) - pos;
+
+        if (mcf->service_batch && is_section_header(&line)) {
+            end_section(sc, log);
+            if (begin_batch_section(sc, &line, log) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        } else if (sc->section != NULL) {
+            xxh64_update(&sc->section_hash, pos, next - pos);
+            parse_server_line(sc->section->new_pool, sc->section_servers,
+                &line, log);
         }
+
+        pos = next;
     }
 
-    return NULL;
+    sc->body.data = pos;
+    sc->body.len = end - pos;
+    return NGX_OK;
 }
 
-static time_t
-get_last_modified_time(struct phr_header *headers, size_t num_headers) {
-    struct phr_header *h = get_header(headers, num_headers, "Last-Modified");
-    if (h == NULL) {
-        return (time_t)-1;
-    }
+// handles the headers of a response, for serverlist sl or for the batch
+// starting at it. returns NGX_ERROR only if the connection should be closed.
+static ngx_int_t
+begin_response(service_conn *sc, serverlist *sl, ngx_log_t *log) {
+    main_conf *mcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+        ngx_http_upstream_serverlist_module);
+    ngx_int_t status = sc->status;
 
-    return ngx_http_parse_time((u_char *)h->value, h->value_len);
-}
+    sc->response_count = sc->claimed_count[sc->serverlists_curr
+        % sc->nclaimed];
 
-static ngx_str_t
-get_etag(struct phr_header *headers, size_t num_headers) {
-    ngx_str_t etag = {0};
-    struct phr_header *h = get_header(headers, num_headers, "Etag");
-    if (h == NULL) {
-        return etag;
+    // failed responses are not re-armed at once, see next_due_ms().
+    if (watch_timeout_ms > 0 && !mcf->service_batch &&
+            (status == 200 || status == 304)) {
+        // see begin_batch_section() for a serverlist still resolving.
+        if (sc->index >= 0 && !sl->resolving) {
+            sl->index = sc->index;
+        } else {
+            sl->index_missed = 1;
+        }
     }
 
-    etag.data = (u_char *)h->value;
-    etag.len = h->value_len;
-    return etag;
-}
+    if (status == 304) {
+        // serverlist not modified.
+        return NGX_OK;
+    } else if (status != 200) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+            "upstream-serverlist: response of serverlist %V%s is not "
+            "200: %i", &sl->name, mcf->service_batch ? " batch" : "", status);
+        return NGX_OK;
+    }
 
-static ngx_int_t
-get_content_length(struct phr_header *headers, size_t num_headers) {
-    struct phr_header *h = get_header(headers, num_headers, "Content-Length");
-    if (h == NULL) {
-        return -1;
+    if (mcf->service_batch) {
+        // sections begin with their header lines.
+        return NGX_OK;
     }
 
-    return ngx_atoi((u_char *)h->value, h->value_len);
+    return begin_section(sc, sl, &sc->etag, sc->last_modified, log);
 }
 
 static void
@@ -1360,37 +5861,175 @@ recv_from_service(ngx_event_t *ev) {
         ngx_http_upstream_serverlist_module);
     ngx_connection_t *c = ev->data;
     service_conn *sc = c->data;
-    serverlist *sl = (serverlist *)mcf->serverlists.elts + sc->serverlists_curr;
+    serverlist *sl = NULL;
 
     ngx_int_t ret = -1;
-    u_char *new_buf = NULL;
+    u_char *new_buf = NULL, *end = NULL;
     int minor_version = 0, status = 0;
     struct phr_header headers[MAX_HTTP_RECEIVED_HEADERS] = {{0}};
     const char *msg = NULL;
-    size_t prev_recv = 0, msglen = 0, bufsize = 0, freesize = 0;
-    size_t num_headers = sizeof headers / sizeof headers[0];
-
-    ngx_str_t etag = {0};
-    time_t last_modified = -1;
-    ngx_int_t content_length = -1;
+    size_t msglen = 0, bufsize = 0, freesize = 0, num_headers = 0;
+    size_t chunk_size = 0;
+    u_char *chunk = NULL;
 
     if (whole_world_exiting()) {
         return;
     }
 
     ngx_log_error(NGX_LOG_DEBUG, ev->log, 0,
-        "upstream-serverlist: recv begin cur %d start %d end %d act %d ready %d",
-        sc->serverlists_curr, sc->serverlists_start, sc->serverlists_end,
-        c->read->active, c->read->ready);
+        "upstream-serverlist: recv begin cur %d sent %d queued %d "
+        "act %d ready %d", sc->serverlists_curr, sc->serverlists_sent,
+        mcf->run_queue.nelts, c->read->active, c->read->ready);
 
     c->read->ready = 0;
 
     while (1) {
+        sl = claimed_serverlist(sc, sc->serverlists_curr);
+
+        if (sc->phase == SERVICE_PHASE_HEADER &&
+                sc->recv.last > sc->recv.start + sc->header_scanned &&
+                sc->serverlists_curr < sc->serverlists_sent) {
+            // with last_len, picohttpparser only looks for the end of headers
+            // in the new bytes, and parses them once they are complete.
+            num_headers = sizeof headers / sizeof headers[0];
+            ret = phr_parse_response((const char *)sc->recv.start,
+                sc->recv.last - sc->recv.start, &minor_version, &status, &msg,
+                &msglen, headers, &num_headers, sc->header_scanned);
+            if (ret == -1) {
+                ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                    "upstream-serverlist: parse http headers of serverlist %V "
+                    "error", &sl->name);
+                goto close_connection;
+            } else if (ret >= 0) {
+                sc->status = status;
+                parse_response_headers(sc, headers, num_headers);
+                if (status == 304 || status == 204) {
+                    sc->content_length = 0;
+                    sc->chunked = 0;
+                } else if (sc->chunked) {
+                    // length known once the last chunk decoded.
+                    sc->content_length = -1;
+                    ngx_memzero(&sc->decoder, sizeof sc->decoder);
+                    sc->decoder.consume_trailer = 1;
+                } else if (sc->content_length < 0) {
+                    ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                        "upstream-serverlist: serverlist %V need content "
+                        "length or chunked body", &sl->name);
+                    goto close_connection;
+                }
+
+                sc->phase = SERVICE_PHASE_BODY;
+                sc->body.data = sc->recv.start + ret;
+                sc->body.len = 0;
+                sc->body_rest = sc->chunked ? 0 : sc->content_length;
+                if (begin_response(sc, sl, ev->log) != NGX_OK) {
+                    goto close_connection;
+                }
+
+                // headers are not needed any more.
+                ngx_str_null(&sc->etag);
+            } else if (ret == -2) {
+                sc->header_scanned = sc->recv.last - sc->recv.start;
+            } else {
+                ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                    "upstream-serverlist: unknown picohttpparser error in "
+                    "serverlist %V", &sl->name);
+                goto close_connection;
+            }
+        }
+
+        if (sc->phase == SERVICE_PHASE_BODY && sc->chunked) {
+            if (sc->body.data + sc->body.len < sc->recv.last) {
+                // decode in place as bytes arrive, the decoded body stays
+                // contiguous from body.data.
+                chunk = sc->body.data + sc->body.len;
+                chunk_size = sc->recv.last - chunk;
+                ret = phr_decode_chunked(&sc->decoder, (char *)chunk,
+                    &chunk_size);
+                if (ret == -1) {
+                    ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                        "upstream-serverlist: decode chunked body of "
+                        "serverlist %V error", &sl->name);
+                    goto close_connection;
+                }
+
+                sc->body.len += chunk_size;
+                // on completion, ret bytes of the next response follow.
+                sc->recv.last = sc->body.data + sc->body.len
+                    + (ret >= 0 ? ret : 0);
+                sc->body_done = ret >= 0;
+            }
+        } else if (sc->phase == SERVICE_PHASE_BODY) {
+            chunk_size = ngx_min(sc->body_rest,
+                (size_t)(sc->recv.last - (sc->body.data + sc->body.len)));
+            sc->body.len += chunk_size;
+            sc->body_rest -= chunk_size;
+            sc->body_done = sc->body_rest == 0;
+        }
+
+        if (sc->phase == SERVICE_PHASE_BODY && sc->body.len > 0) {
+            // parse lines as they arrive, so only a partial line is kept.
+            if (consume_body(sc, ev->log) != NGX_OK) {
+                goto close_connection;
+            }
+        }
+
+        if (sc->phase == SERVICE_PHASE_BODY && sc->body_done) {
+            end_section(sc, ev->log);
+            unclaim_response(mcf, sc);
+
+            // keep bytes of pipelined responses behind this one.
+            end = sc->body.data + sc->body.len;
+            sc->recv.last = ngx_movemem(sc->recv.start, end,
+                sc->recv.last - end);
+            sc->recv.pos = sc->recv.start;
+            reset_response(sc);
+
+            if (sc->serverlists_curr >= sc->serverlists_sent &&
+                    mcf->run_queue.nelts <= 0) {
+                goto finished;
+            }
+
+            if (sc->serverlists_curr < sc->serverlists_sent) {
+                ngx_add_timer(&sc->timeout_timer,
+                    claimed_timeout_ms(sc, sc->serverlists_curr));
+            } else {
+                ngx_del_timer(&sc->timeout_timer);
+            }
+
+            // refill the pipeline from the run queue.
+            if (mcf->run_queue.nelts > 0 &&
+                    sc->send.last == sc->send.start) {
+                ret = ngx_handle_write_event(c->write, 0);
+                if (ret < 0) {
+                    ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                        "upstream-serverlist: handle write event failed");
+                    goto close_connection;
+                }
+            }
+
+            continue;
+        }
+
+        if (sc->serverlists_curr >= sc->serverlists_sent) {
+            // no request in flight, wait send_to_service.
+            return;
+        }
+
         freesize = sc->recv.end - sc->recv.last;
+        if (freesize <= 0 && sc->phase == SERVICE_PHASE_BODY &&
+                sc->body.data > sc->recv.start) {
+            // drop parsed bytes, keep the partial line and bytes not decoded.
+            sc->recv.last = ngx_movemem(sc->recv.start, sc->body.data,
+                sc->recv.last - sc->body.data);
+            sc->recv.pos = sc->body.data = sc->recv.start;
+            freesize = sc->recv.end - sc->recv.last;
+        }
+
         if (freesize <= 0) {
-            /* buffer not big enough? enlarge it by twice */
+            /* headers or a line not fit? enlarge it by twice */
             bufsize = sc->recv.end - sc->recv.start;
-            new_buf = ngx_pcalloc(mcf->conf_pool, bufsize * 2);
+            new_buf = ngx_alloc(bufsize * 2, ev->log);
             if (new_buf == NULL) {
                 ngx_log_error(NGX_LOG_ERR, ev->log, 0,
                     "upstream-serverlist: allocate recv buf failed");
@@ -1403,6 +6042,12 @@ recv_from_service(ngx_event_t *ev) {
                 sc->body.data = new_buf + (sc->body.data - sc->recv.start);
             }
 
+            if (sc->recv.start == sc->recv_cl->buf->start) {
+                // the link gets a new page once given back.
+                sc->recv_cl->buf->start = NULL;
+                sc->recv_cl->buf->end = NULL;
+            }
+            ngx_free(sc->recv.start);
             sc->recv.pos = sc->recv.start = new_buf;
             sc->recv.last = new_buf + bufsize;
             sc->recv.end = new_buf + bufsize * 2;
@@ -1411,81 +6056,14 @@ recv_from_service(ngx_event_t *ev) {
 
         ret = c->recv(c, sc->recv.last, freesize);
         if (ret > 0) {
-            prev_recv = sc->recv.last - sc->recv.start;
             sc->recv.last += ret;
-
-            if (sc->content_length >= 0) {
-                sc->body.len += ret;
-                if ((int)sc->body.len == sc->content_length) {
-                    break;
-                } else if ((int)sc->body.len > sc->content_length) {
-                    ngx_log_error(NGX_LOG_ERR, ev->log, 0,
-                        "upstream-serverlist: serverlist %V body too big",
-                        &sl->name, sc->content_length, sc->body.len);
-                    goto close_connection;
-                }
-            }
-
-            ret = phr_parse_response((const char *)sc->recv.start,
-                sc->recv.last - sc->recv.start, &minor_version,
-                &status, &msg, &msglen, headers, &num_headers, prev_recv);
-            if (ret == -1) {
-                ngx_log_error(NGX_LOG_ERR, ev->log, 0,
-                    "upstream-serverlist: parse http headers of serverlist %V "
-                    "error", &sl->name);
-                goto close_connection;
-            } else if (ret == -2) {
-                ngx_log_error(NGX_LOG_DEBUG, ev->log, 0,
-                    "upstream-serverlist: header incomplete");
-                continue;
-            } else if (ret < 0) {
-                ngx_log_error(NGX_LOG_ERR, ev->log, 0,
-                    "upstream-serverlist: unknown picohttpparser error in "
-                    "serverlist %V", &sl->name);
-                goto close_connection;
-            } else if (status == 304) {
-                // serverlist not modified.
-                goto exit;
-            } else if (status != 200) {
-                ngx_log_error(NGX_LOG_ERR, ev->log, 0,
-                    "upstream-serverlist: response of serverlist %V is not "
-                    "200: %d", &sl->name, status);
-                goto exit;
-            }
-
-            content_length = get_content_length(headers, num_headers);
-            if (content_length < 0) {
-                ngx_log_error(NGX_LOG_ERR, ev->log, 0,
-                    "upstream-serverlist: serverlist %V need content length",
-                    &sl->name);
-                goto close_connection;
-            }
-
-            sc->content_length = content_length;
-            sc->body.data = sc->recv.start + ret;
-            sc->body.len = sc->recv.last - sc->body.data;
-            if ((int)sc->body.len == sc->content_length) {
-                break;
-            } else if ((int)sc->body.len > sc->content_length) {
-                ngx_log_error(NGX_LOG_ERR, ev->log, 0,
-                    "upstream-serverlist: serverlist %V body too big",
-                    &sl->name, sc->content_length, sc->body.len);
-                goto close_connection;
-            }
-
-            ngx_log_error(NGX_LOG_DEBUG, ev->log, 0,
-                "upstream-serverlist: body incomplete: received %d, content "
-                "length %d", (int)sc->body.len, sc->content_length);
             continue;
         } else if (ret == 0 || ngx_socket_errno == NGX_ECONNRESET) {
             // remote peer closed, leading 2 results: 1) header incomplete. 2)
             // body incomplete. every result need discard the connection.
             ngx_log_error(NGX_LOG_DEBUG, ev->log, 0,
                 "upstream-serverlist: connection closed");
-            ngx_close_connection(sc->peer_conn.connection);
-            sc->peer_conn.connection = NULL;
-            ngx_del_timer(&sc->timeout_timer);
-            ngx_add_timer(&sc->refresh_timer, 1);
+            fail_service_conn(sc, 1);
             return;
         } else if (ret == NGX_AGAIN) {
             ngx_log_error(NGX_LOG_INFO, ev->log, 0,
@@ -1501,136 +6079,18 @@ recv_from_service(ngx_event_t *ev) {
         }
     }
 
-    if (sl->new_pool != NULL) {
-        // unlikely, is a critical bug.
-        ngx_log_error(NGX_LOG_CRIT, ev->log, 0,
-            "upstream-serverlist: new pool of sl %V is existing",
-            &sl->name);
-        ngx_destroy_pool(sl->new_pool);
-        sl->new_pool = NULL;
-    }
+finished:
+    ngx_log_error(NGX_LOG_DEBUG, ev->log, 0,
+        "upstream-serverlist: recv end cur %d act %d ready %d",
+        sc->serverlists_curr, c->read->active, c->read->ready);
 
-    sl->new_pool = ngx_create_pool(DEFAULT_SERVERLIST_POOL_SIZE, ev->log);
-    if (sl->new_pool == NULL) {
-        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
-            "upstream-serverlist: create new pool failed");
+    // the connection idles until serverlists are queued again.
+    if (rest_service_conn(mcf, sc, ev->log) != NGX_OK) {
         goto close_connection;
     }
 
-    etag = get_etag(headers, num_headers);
-    if (etag.len > 0) {
-        if (sl->etag.len <= 0 || ngx_strncasecmp(sl->etag.data, etag.data,
-                ngx_min(sl->etag.len, etag.len)) != 0) {
-            sl->etag.data = ngx_pstrdup(sl->new_pool, &etag);
-            if (!sl->etag.data) {
-                ngx_log_error(NGX_LOG_ERR, ev->log, 0,
-                    "upstream-serverlist: allocate etag data failed");
-                goto destroy_new_pool;
-            }
-            sl->etag.len = etag.len;
-        } else {
-            ngx_destroy_pool(sl->new_pool);
-            sl->new_pool = NULL;
-            goto exit;
-        }
-    } else if (sl->etag.len > 0) {
-        ngx_memzero(&sl->etag, sizeof sl->etag);
-    }
-
-    last_modified = get_last_modified_time(headers, num_headers);
-    if (last_modified >= 0) {
-        if (last_modified > sl->last_modified) {
-            sl->last_modified = last_modified;
-        } else if (etag.len <= 0) {
-            ngx_destroy_pool(sl->new_pool);
-            sl->new_pool = NULL;
-            goto exit;
-        }
-    } else {
-        sl->last_modified = -1;
-    }
-
-    ret = refresh_upstream(sl, &sc->body, ev->log);
-    if (ret < 0) {
-        // ensure force refresh in next round, and clean pointers to new pool.
-        sl->last_modified = -1;
-        ngx_memzero(&sl->etag, sizeof sl->etag);
-        ngx_destroy_pool(sl->new_pool);
-        sl->new_pool = NULL;
-        goto exit;
-    }
-
-    if (sl->pool != NULL) {
-        // the pool is NULL at first run.
-        ngx_destroy_pool(sl->pool);
-    }
-
-    sl->pool = sl->new_pool;
-
-    if (sl->new_pool != NULL) {
-        ngx_destroy_pool(sl->new_pool);
-        sl->new_pool = NULL;
-    }
-
-exit:
-    if (sc->serverlists_curr + 1 >= sc->serverlists_end) {
-        ngx_time_t *now = ngx_timeofday();
-        ngx_log_error(NGX_LOG_INFO, ev->log, 0,
-            "upstream-serverlist: finished refresh serverlists from %d to %d, "
-            "elapsed: %dms", sc->serverlists_start, sc->serverlists_end,
-            (now->sec - sc->start_time.sec) * 1000 + now->msec
-                - sc->start_time.msec);
-
-        sc->serverlists_curr = sc->serverlists_start;
-        ngx_memzero(&sc->start_time, sizeof sc->start_time);
-        c->write->handler = empty_handler;
-        c->read->handler = idle_conn_read_handler;
-
-        ret = ngx_handle_read_event(c->read, 0);
-        if (ret < 0) {
-            ngx_log_error(NGX_LOG_ERR, ev->log, 0,
-                "upstream-serverlist: handle read event failed");
-            goto close_connection;
-        }
-
-        ngx_add_timer(&sc->refresh_timer, random_interval_ms());
-    } else {
-        // recv is over, cleaning.
-        sc->serverlists_curr++;
-        sc->content_length = -1;
-        sc->recv.pos = sc->recv.last = sc->recv.start;
-        ngx_memzero(&sc->body, sizeof sc->body);
-
-        ret = ngx_del_event(c->read, NGX_READ_EVENT, 0);
-        if (ret < 0) {
-            ngx_log_error(NGX_LOG_ERR, ev->log, 0,
-                "upstream-serverlist: del read event failed");
-            goto close_connection;
-        }
-
-        ret = ngx_handle_write_event(c->write, 0);
-        if (ret < 0) {
-            ngx_log_error(NGX_LOG_ERR, ev->log, 0,
-                "upstream-serverlist: handle write event failed");
-            goto close_connection;
-        }
-    }
-
-    ngx_del_timer(&sc->timeout_timer);
-
-    ngx_log_error(NGX_LOG_DEBUG, ev->log, 0,
-        "upstream-serverlist: recv end cur %d start %d end %d act %d ready %d",
-        sc->serverlists_curr, sc->serverlists_start, sc->serverlists_end,
-        c->read->active, c->read->ready);
     return;
 
-destroy_new_pool:
-    ngx_destroy_pool(sl->new_pool);
-    sl->new_pool = NULL;
-
 close_connection:
-    ngx_close_connection(sc->peer_conn.connection);
-    sc->peer_conn.connection = NULL;
-    ngx_del_timer(&sc->timeout_timer);
-    ngx_add_timer(&sc->refresh_timer, random_interval_ms());
+    fail_service_conn(sc, random_interval_ms());
 }
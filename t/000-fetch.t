@@ -0,0 +1,147 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket;
+
+repeat_each(1);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: placeholder server replaced by the fetched one
+--- http_config
+    serverlist_service url=http://127.0.0.1:$TEST_NGINX_SERVER_PORT/lists/ interval=100ms;
+
+    upstream backend {
+        serverlist;
+        server 127.255.255.255 down;
+    }
+
+    server {
+        listen 127.0.0.1:$TEST_NGINX_RAND_PORT_1;
+        location / {
+            return 200 "a\n";
+        }
+    }
+--- config
+    location = /lists/backend {
+        return 200 "server 127.0.0.1:$TEST_NGINX_RAND_PORT_1;\n";
+    }
+
+    location = /t {
+        proxy_pass http://backend/;
+    }
+--- raw_request eval
+["GET /t HTTP/1.0\r\n", "\r\n"]
+--- raw_request_middle_delay: 1
+--- response_body
+a
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: chunked response of the service
+--- http_config
+    serverlist_service url=http://127.0.0.1:$TEST_NGINX_SERVER_PORT/lists/ interval=100ms;
+
+    upstream backend {
+        serverlist;
+        server 127.255.255.255 down;
+    }
+
+    server {
+        listen 127.0.0.1:$TEST_NGINX_RAND_PORT_1;
+        location / {
+            return 200 "a\n";
+        }
+    }
+--- config
+    location = /lists/backend {
+        # ssi drops Content-Length, so the response is chunked.
+        default_type text/plain;
+        ssi on;
+        ssi_types text/plain;
+        # the last line has no line feed.
+        return 200 "server 127.0.0.1:$TEST_NGINX_RAND_PORT_1 weight=2;";
+    }
+
+    location = /t {
+        proxy_pass http://backend/;
+    }
+--- raw_request eval
+["GET /t HTTP/1.0\r\n", "\r\n"]
+--- raw_request_middle_delay: 1
+--- response_body
+a
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: unchanged body skipped by its hash
+--- http_config
+    serverlist_service url=http://127.0.0.1:$TEST_NGINX_SERVER_PORT/lists/ interval=100ms;
+
+    upstream backend {
+        serverlist;
+        server 127.255.255.255 down;
+    }
+
+    server {
+        listen 127.0.0.1:$TEST_NGINX_RAND_PORT_1;
+        location / {
+            return 200 "a\n";
+        }
+    }
+--- config
+    location = /lists/backend {
+        return 200 "server 127.0.0.1:$TEST_NGINX_RAND_PORT_1;\n";
+    }
+
+    location = /t {
+        proxy_pass http://backend/;
+    }
+--- raw_request eval
+["GET /t HTTP/1.0\r\n", "\r\n"]
+--- raw_request_middle_delay: 1
+--- response_body
+a
+--- error_log
+body unchanged, skip
+
+
+
+=== TEST 4: status other than 200 keeps the old servers
+--- http_config
+    serverlist_service url=http://127.0.0.1:$TEST_NGINX_SERVER_PORT/lists/ interval=100ms;
+
+    upstream backend {
+        serverlist;
+        server 127.0.0.1:$TEST_NGINX_RAND_PORT_1;
+    }
+
+    server {
+        listen 127.0.0.1:$TEST_NGINX_RAND_PORT_1;
+        location / {
+            return 200 "a\n";
+        }
+    }
+--- config
+    location = /lists/backend {
+        return 503;
+    }
+
+    location = /t {
+        proxy_pass http://backend/;
+    }
+--- raw_request eval
+["GET /t HTTP/1.0\r\n", "\r\n"]
+--- raw_request_middle_delay: 1
+--- response_body
+a
+--- error_log
+is not 200: 503
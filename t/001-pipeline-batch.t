@@ -0,0 +1,141 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket;
+
+repeat_each(1);
+
+plan tests => repeat_each() * (blocks() * 2);
+
+our $HttpConfig = <<'_EOC_';
+    upstream one {
+        serverlist;
+        server 127.255.255.255 down;
+    }
+
+    upstream two {
+        serverlist;
+        server 127.255.255.255 down;
+    }
+
+    upstream three {
+        serverlist;
+        server 127.255.255.255 down;
+    }
+
+    server {
+        listen 127.0.0.1:$TEST_NGINX_RAND_PORT_1;
+        location / {
+            return 200 "a\n";
+        }
+    }
+
+    server {
+        listen 127.0.0.1:$TEST_NGINX_RAND_PORT_2;
+        location / {
+            return 200 "b\n";
+        }
+    }
+
+    server {
+        listen 127.0.0.1:$TEST_NGINX_RAND_PORT_3;
+        location / {
+            return 200 "c\n";
+        }
+    }
+_EOC_
+
+our $Config = <<'_EOC_';
+    location ~ ^/p/(\w+)$ {
+        proxy_pass http://$1/;
+    }
+
+    # one response of all upstreams.
+    location = /t {
+        default_type text/plain;
+        ssi on;
+        ssi_types text/plain;
+        return 200 '<!--# include virtual="/p/one" --><!--# include virtual="/p/two" --><!--# include virtual="/p/three" -->';
+    }
+_EOC_
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: pipelined requests, with chunked responses
+--- http_config eval
+"serverlist_service url=http://127.0.0.1:\$TEST_NGINX_SERVER_PORT/lists/ interval=100ms pipeline=4;\n" . $::HttpConfig
+--- config eval
+$::Config . <<'_EOC_';
+    location ~ ^/lists/(\w+)$ {
+        default_type text/plain;
+        ssi on;
+        ssi_types text/plain;
+        set $port $TEST_NGINX_RAND_PORT_1;
+        if ($1 = two) {
+            set $port $TEST_NGINX_RAND_PORT_2;
+        }
+        if ($1 = three) {
+            set $port $TEST_NGINX_RAND_PORT_3;
+        }
+        return 200 "server 127.0.0.1:$port;\n";
+    }
+_EOC_
+--- raw_request eval
+["GET /t HTTP/1.0\r\n", "\r\n"]
+--- raw_request_middle_delay: 1
+--- response_body
+a
+b
+c
+
+
+
+=== TEST 2: pipelined requests, with Content-Length responses
+--- http_config eval
+"serverlist_service url=http://127.0.0.1:\$TEST_NGINX_SERVER_PORT/lists/ interval=100ms pipeline=4;\n" . $::HttpConfig
+--- config eval
+$::Config . <<'_EOC_';
+    location = /lists/one {
+        return 200 "server 127.0.0.1:$TEST_NGINX_RAND_PORT_1;\n";
+    }
+
+    location = /lists/two {
+        return 200 "server 127.0.0.1:$TEST_NGINX_RAND_PORT_2;\n";
+    }
+
+    location = /lists/three {
+        return 200 "server 127.0.0.1:$TEST_NGINX_RAND_PORT_3;\n";
+    }
+_EOC_
+--- raw_request eval
+["GET /t HTTP/1.0\r\n", "\r\n"]
+--- raw_request_middle_delay: 1
+--- response_body
+a
+b
+c
+
+
+
+=== TEST 3: batch sections, one of them not modified
+--- http_config eval
+"serverlist_service url=http://127.0.0.1:\$TEST_NGINX_SERVER_PORT/lists/ interval=100ms batch=4;\n" . $::HttpConfig
+--- config eval
+$::Config . <<'_EOC_';
+    location = /lists/ {
+        # sections of serverlists not requested in a batch are only logged.
+        default_type text/plain;
+        ssi on;
+        ssi_types text/plain;
+        return 200 "serverlist one etag=\"v1\";\nserver 127.0.0.1:$TEST_NGINX_RAND_PORT_1;\nserverlist two;\nserver 127.0.0.1:$TEST_NGINX_RAND_PORT_2;\nserverlist three;\nserver 127.0.0.1:$TEST_NGINX_RAND_PORT_3;\nserverlist four not_modified;\n";
+    }
+_EOC_
+--- raw_request eval
+["GET /t HTTP/1.0\r\n", "\r\n"]
+--- raw_request_middle_delay: 1
+--- response_body
+a
+b
+c
@@ -0,0 +1,102 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket;
+
+repeat_each(1);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+our $HttpConfig = <<'_EOC_';
+    serverlist_service url=http://127.0.0.1:$TEST_NGINX_SERVER_PORT/lists/ interval=100ms;
+
+    upstream backend {
+        serverlist;
+        server 127.255.255.255 down;
+    }
+
+    server {
+        listen 127.0.0.1:$TEST_NGINX_RAND_PORT_1;
+        location / {
+            return 200 "a\n";
+        }
+    }
+
+    server {
+        listen 127.0.0.1:$TEST_NGINX_RAND_PORT_2;
+        location / {
+            return 200 "b\n";
+        }
+    }
+_EOC_
+
+# the service connection is kept alive, its first fetch gets the first list and
+# later ones the second.
+our $Config = <<'_EOC_';
+    location = /lists/backend {
+        return 200 $list;
+    }
+
+    location = /t {
+        proxy_pass http://backend/;
+    }
+_EOC_
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: weight changed, peers patched in place
+--- http_config eval
+$::HttpConfig . <<'_EOC_';
+    map $connection_requests $list {
+        1       "server 127.0.0.1:$TEST_NGINX_RAND_PORT_1 weight=1;\n";
+        default "server 127.0.0.1:$TEST_NGINX_RAND_PORT_1 weight=2;\n";
+    }
+_EOC_
+--- config eval: $::Config
+--- raw_request eval
+["GET /t HTTP/1.0\r\n", "\r\n"]
+--- raw_request_middle_delay: 1
+--- response_body
+a
+--- error_log
+serverlist backend changed, added 0 removed 0 modified 1
+
+
+
+=== TEST 2: server replaced, peers rebuilt
+--- http_config eval
+$::HttpConfig . <<'_EOC_';
+    map $connection_requests $list {
+        1       "server 127.0.0.1:$TEST_NGINX_RAND_PORT_1;\n";
+        default "server 127.0.0.1:$TEST_NGINX_RAND_PORT_2;\n";
+    }
+_EOC_
+--- config eval: $::Config
+--- raw_request eval
+["GET /t HTTP/1.0\r\n", "\r\n"]
+--- raw_request_middle_delay: 1
+--- response_body
+b
+--- error_log
+serverlist backend changed, added 1 removed 1 modified 0
+
+
+
+=== TEST 3: primary server down, backup server added
+--- http_config eval
+$::HttpConfig . <<'_EOC_';
+    map $connection_requests $list {
+        1       "server 127.0.0.1:$TEST_NGINX_RAND_PORT_1;\n";
+        default "server 127.0.0.1:$TEST_NGINX_RAND_PORT_1 down;\nserver 127.0.0.1:$TEST_NGINX_RAND_PORT_2 backup;\n";
+    }
+_EOC_
+--- config eval: $::Config
+--- raw_request eval
+["GET /t HTTP/1.0\r\n", "\r\n"]
+--- raw_request_middle_delay: 1
+--- response_body
+b
+--- error_log
+serverlist backend changed, added 1 removed 0 modified 1
@@ -0,0 +1,104 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket;
+
+repeat_each(1);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+# the refused server is tried first by its weight, so a request only gets an
+# answer if the peers allow a second try.
+our $HttpConfig = <<'_EOC_';
+    serverlist_service url=http://127.0.0.1:$TEST_NGINX_SERVER_PORT/lists/ interval=100ms;
+
+    map $connection_requests $list {
+        1       "server 127.0.0.1:$TEST_NGINX_RAND_PORT_1;\n";
+        default "server 127.0.0.1:$TEST_NGINX_RAND_PORT_3 weight=10;\nserver 127.0.0.1:$TEST_NGINX_RAND_PORT_2;\n";
+    }
+
+    server {
+        listen 127.0.0.1:$TEST_NGINX_RAND_PORT_1;
+        location / {
+            return 200 "a\n";
+        }
+    }
+
+    server {
+        listen 127.0.0.1:$TEST_NGINX_RAND_PORT_2;
+        location / {
+            return 200 "b\n";
+        }
+    }
+_EOC_
+
+our $Config = <<'_EOC_';
+    location = /lists/backend {
+        return 200 $list;
+    }
+
+    location = /t {
+        proxy_pass http://backend/;
+    }
+_EOC_
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: peers written into the upstream zone
+--- http_config eval
+$::HttpConfig . <<'_EOC_';
+    upstream backend {
+        zone backend 64k;
+        serverlist;
+        server 127.255.255.255 down;
+    }
+_EOC_
+--- config eval: $::Config
+--- raw_request eval
+["GET /t HTTP/1.0\r\n", "\r\n"]
+--- raw_request_middle_delay: 1
+--- response_body
+b
+--- error_log
+Connection refused
+
+
+
+=== TEST 2: peers flipped between reserved slots
+--- http_config eval
+$::HttpConfig . <<'_EOC_';
+    upstream backend {
+        serverlist max_servers=4;
+        server 127.255.255.255 down;
+    }
+_EOC_
+--- config eval: $::Config
+--- raw_request eval
+["GET /t HTTP/1.0\r\n", "\r\n"]
+--- raw_request_middle_delay: 1
+--- response_body
+b
+--- error_log
+Connection refused
+
+
+
+=== TEST 3: reserved slots in the upstream zone
+--- http_config eval
+$::HttpConfig . <<'_EOC_';
+    upstream backend {
+        zone backend 64k;
+        serverlist max_servers=4;
+        server 127.255.255.255 down;
+    }
+_EOC_
+--- config eval: $::Config
+--- raw_request eval
+["GET /t HTTP/1.0\r\n", "\r\n"]
+--- raw_request_middle_delay: 1
+--- response_body
+b
+--- error_log
+Connection refused